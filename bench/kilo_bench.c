@@ -0,0 +1,539 @@
+/*** includes ***/
+
+// The editor is built without its main() to call its functions directly
+#define KILO_NO_MAIN
+#include "../src/kilo.c"
+
+/*** defines ***/
+
+#define BENCH_REPEAT 5 // Runs of each measurement, the best one is reported
+#define BENCH_DRAW_ROWS 60 // Screen size of the drawing benchmark
+#define BENCH_DRAW_COLS 200
+#define BENCH_DRAW_FRAMES 2000 // Frames drawn in each run
+#define BENCH_KEYWORDS 400 // Keywords of the large table in the keyword benchmark
+#define BENCH_KEYWORD_TEXT (4 * 1024 * 1024) // Size of the text to look up keywords in
+#define BENCH_LEX_LINES 40000 // Lines of C code in the lexer benchmark
+
+/*** utilities ***/
+
+// Get the time of the monotonic clock in seconds
+double benchNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+// Generate a file of lines with the average length and map it
+char* benchGenerateFile(const size_t size, const int linelen, const int crlf) {
+    char path[] = "/tmp/kilo-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        die("mkstemp");
+    }
+    unlink(path);
+
+    char* buf = malloc(size);
+    if (buf == NULL) {
+        die("malloc");
+    }
+    srand(1);
+    for (size_t i = 0; i < size; i++) {
+        buf[i] = 'a' + (rand() % 26);
+        if ((rand() % linelen) == 0) {
+            if (crlf && (i > 0)) {
+                buf[i - 1] = '\r';
+            }
+            buf[i] = '\n';
+        }
+    }
+    if (write(fd, buf, size) != (ssize_t)size) {
+        die("write");
+    }
+    free(buf);
+
+    char* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        die("mmap");
+    }
+    close(fd);
+    return map;
+}
+
+// Generate a C source file dense with highlighted tokens and open it
+void benchOpenSource(const int lines) {
+    char path[] = "/tmp/kilo-bench-XXXXXX.c";
+    int fd = mkstemps(path, 2);
+    if (fd == -1) {
+        die("mkstemps");
+    }
+    FILE* fp = fdopen(fd, "w");
+    for (int i = 0; i < lines; i++) {
+        switch (i % 4) {
+            case 0:
+                fprintf(fp, "    if ((x%d == 0x%x) && (y < %d.5)) { return \"case %d\"; } "
+                    "else { continue; } // check %d of the table for overflow\n",
+                    i, i, i, i, i);
+                break;
+            case 1:
+                fprintf(fp, "static const unsigned int value%d = %d; /* %d */ "
+                    "char* s%d = \"text\\n\"; int n%d = sizeof(struct row) * %d;\n",
+                    i, (i * 7), i, i, i, i);
+                break;
+            case 2:
+                fprintf(fp, "\tfor (int j = 0; j < %d; j++) { switch (k) { case %d: "
+                    "break; default: while (%d) { k++; } } }\n", i, i, i);
+                break;
+            default:
+                fprintf(fp, "/* comment %d with some words spanning the line to the "
+                    "right edge of a wide terminal window */ double d%d = %d.25;\n",
+                    i, i, i);
+                break;
+        }
+    }
+    fclose(fp);
+
+    E.rowarena.name = "rows";
+    E.hl_gen = 1;
+    E.hl_stale = INT_MAX;
+    E.rowtree = editorRowNodeNew(1);
+    editorOpen(path);
+    unlink(path);
+}
+
+// Draw rows one cell at a time, formatting every color change
+void benchDrawRowsPerCell(struct abuf* ab) {
+    for (int y = 0; y < E.screenrows; y++) {
+        erow* row = editorRowAt(y + E.rowoff);
+        editorRowMaterialize(row);
+        int len = row->rsize - E.coloff;
+        if (len < 0) {
+            len = 0;
+        }
+        if (len > E.screencols) {
+            len = E.screencols;
+        }
+        char* c = &row->render[E.coloff];
+        unsigned char* hl = &row->hl[E.coloff];
+        int current_color = -1;
+        for (int j = 0; j < len; j++) {
+            if (iscntrl(c[j])) {
+                char sym = (c[j] <= 26) ? ('@' + c[j]) : '?';
+                abAppend(ab, "\x1b[7m", 4);
+                abAppend(ab, &sym, 1);
+                abAppend(ab, "\x1b[m", 3);
+                if (current_color != -1) {
+                    char buf[16];
+                    int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
+                    abAppend(ab, buf, clen);
+                }
+            } else if (hl[j] == HL_NORMAL) {
+                if (current_color != -1) {
+                    abAppend(ab, "\x1b[39m", 5);
+                    current_color = -1;
+                }
+                abAppend(ab, &c[j], 1);
+            } else {
+                int color = editorSyntaxToColor(hl[j]);
+                if (color != current_color) {
+                    current_color = color;
+                    char buf[16];
+                    int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+                    abAppend(ab, buf, clen);
+                }
+                abAppend(ab, &c[j], 1);
+            }
+        }
+        abAppend(ab, "\x1b[39m", 5);
+        abAppend(ab, "\x1b[K", 3);
+        abAppend(ab, "\r\n", 2);
+    }
+}
+
+// Check the character is a separator character with the library calls
+int benchIsSeparator(int c) {
+    return isspace((unsigned char)c) || (c == '\0') || (strchr(",.()+-/*=~%<>[];", c) != NULL);
+}
+
+// Find the keyword at the start of the text by comparing every keyword
+int benchKeywordLinear(char** keywords, const char* s, int* len) {
+    for (int j = 0; keywords[j]; j++) {
+        int klen = strlen(keywords[j]);
+        int kw2 = keywords[j][klen - 1] == '|';
+        if (kw2) {
+            klen--;
+        }
+        if (!strncmp(s, keywords[j], klen) && benchIsSeparator(s[klen])) {
+            *len = klen;
+            return kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+        }
+    }
+    return HL_NORMAL;
+}
+
+// Highlight the characters like editorLexSpan() by testing every rule
+// at each character with the library calls
+int benchLexSpanChained(const char* s, int i, const int stop, const int end,
+    unsigned char* hl, struct lexState* st) {
+    char* scs = E.syntax->singleline_comment_start;
+    char* mcs = E.syntax->multiline_comment_start;
+    char* mce = E.syntax->multiline_comment_end;
+
+    int scs_len = scs ? strlen(scs) : 0;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    int mce_len = mce ? strlen(mce) : 0;
+
+    if (st->line_comment && (i < stop)) {
+        memset(&hl[i], HL_COMMENT, (stop - i));
+        return stop;
+    }
+
+    while (i < stop) {
+        char c = s[i];
+        unsigned char prev_hl = (i > 0) ? hl[i - 1] : (st->number ? HL_NUMBER : HL_NORMAL);
+
+        if (scs_len && !st->in_string && !st->in_comment) {
+            if (!strncmp(&s[i], scs, scs_len)) {
+                memset(&hl[i], HL_COMMENT, (stop - i));
+                st->line_comment = 1;
+                i = stop;
+                break;
+            }
+        }
+
+        if (mcs_len && mce_len && !st->in_string) {
+            if (st->in_comment) {
+                hl[i] = HL_MLCOMMENT;
+                if (!strncmp(&s[i], mce, mce_len)) {
+                    memset(&hl[i], HL_MLCOMMENT, mce_len);
+                    i += mce_len;
+                    st->in_comment = 0;
+                    st->prev_sep = 1;
+                    continue;
+                } else {
+                    i++;
+                    continue;
+                }
+            } else if (!strncmp(&s[i], mcs, mcs_len)) {
+                memset(&hl[i], HL_MLCOMMENT, mcs_len);
+                i += mcs_len;
+                st->in_comment = 1;
+                continue;
+            }
+        }
+
+        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+            if (st->in_string) {
+                hl[i] = HL_STRING;
+                if (c == '\\' && ((i + 1) < end)) {
+                    hl[i + 1] = HL_STRING;
+                    i += 2;
+                    continue;
+                }
+                if (c == st->in_string) {
+                    st->in_string = 0;
+                }
+                i++;
+                st->prev_sep = 1;
+                continue;
+            } else {
+                if ((c == '"') || (c == '\'')) {
+                    st->in_string = c;
+                    hl[i] = HL_STRING;
+                    i++;
+                    continue;
+                }
+            }
+        }
+
+        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+            if ((isdigit((unsigned char)c) && (st->prev_sep || (prev_hl == HL_NUMBER))) ||
+                ((c == '.') && (prev_hl == HL_NUMBER))) {
+                hl[i] = HL_NUMBER;
+                i++;
+                st->prev_sep = 0;
+                continue;
+            }
+        }
+
+        if (st->prev_sep) {
+            int klen;
+            int kw = editorKeywordFind(&E.keywords, &s[i], &klen);
+            if (kw != HL_NORMAL) {
+                memset(&hl[i], kw, klen);
+                i += klen;
+                st->prev_sep = 0;
+                continue;
+            }
+        }
+
+        st->prev_sep = benchIsSeparator(c);
+        i++;
+    }
+
+    if (i > 0) {
+        st->number = (hl[i - 1] == HL_NUMBER);
+    }
+    return i;
+}
+
+// Generate words of the keywords and identifiers between separators
+char* benchGenerateWords(char** keywords, const int n, const size_t size) {
+    char* buf = malloc(size + 1);
+    if (buf == NULL) {
+        die("malloc");
+    }
+    const char* seps = " ();,*";
+    srand(1);
+    size_t len = 0;
+    while (len < size) {
+        char word[32];
+        int wlen;
+        if ((rand() % 3) == 0) {
+            const char* k = keywords[rand() % n];
+            wlen = strlen(k) - (k[strlen(k) - 1] == '|');
+            memcpy(word, k, wlen);
+        } else {
+            wlen = snprintf(word, sizeof(word), "name%d", (rand() % 1000));
+        }
+        word[wlen++] = seps[rand() % 6];
+        if ((len + wlen) > size) {
+            break;
+        }
+        memcpy(&buf[len], word, wlen);
+        len += wlen;
+    }
+    memset(&buf[len], ' ', (size - len));
+    buf[size] = '\0';
+    return buf;
+}
+
+/*** benchmarks ***/
+
+// Measure the CPU time to draw frames of highlighted C code
+void benchDraw(void) {
+    E.screenrows = BENCH_DRAW_ROWS - 2;
+    E.screencols = BENCH_DRAW_COLS;
+    editorScreenInit();
+    benchOpenSource(4000);
+    int scroll = E.numrows - E.screenrows;
+
+    printf("drawing: %dx%d screen of highlighted C code, %d frames per run\n",
+        BENCH_DRAW_COLS, BENCH_DRAW_ROWS, BENCH_DRAW_FRAMES);
+    const char* names[] = { "per cell", "spans", "spans diff", "hw scroll" };
+    double times[4];
+    for (int m = 0; m < 4; m++) {
+        struct abuf ab = ABUF_INIT;
+        size_t bytes = 0;
+        double best = 0;
+        for (int r = 0; r < BENCH_REPEAT; r++) {
+            bytes = 0;
+            double start = benchNow();
+            for (int f = 0; f < BENCH_DRAW_FRAMES; f++) {
+                // Every other frame scrolls a line in the diff modes
+                int rowoff = E.rowoff;
+                E.rowoff = (m >= 2) ? ((f / 2) % scroll) : (f % scroll);
+                ab.len = 0;
+                if (m == 0) {
+                    benchDrawRowsPerCell(&ab);
+                } else {
+                    if (m == 3) {
+                        editorScreenScroll(&ab, (E.rowoff - rowoff));
+                    }
+                    editorDrawRows();
+                    editorScreenFlush(&ab, (m == 1), 0, 0);
+                }
+                bytes += ab.len;
+            }
+            double t = benchNow() - start;
+            if ((r == 0) || (t < best)) {
+                best = t;
+            }
+        }
+        times[m] = best;
+        printf("  %-10s: %8.1f us/frame, %7zu bytes/frame, %5.1fx\n", names[m],
+            (best / BENCH_DRAW_FRAMES * 1e6), (bytes / BENCH_DRAW_FRAMES),
+            (times[0] / best));
+        abFree(&ab);
+    }
+}
+
+// Measure the lookup of keywords at the words of a text, scanning the keyword
+// list against the perfect hash table
+void benchKeywords(void) {
+    // The C keywords followed by made-up ones for a language with many keywords
+    static char names[BENCH_KEYWORDS][16];
+    static char* many[BENCH_KEYWORDS + 1];
+    int nc = 0;
+    while (C_HL_keywords[nc]) {
+        many[nc] = C_HL_keywords[nc];
+        nc++;
+    }
+    for (int j = nc; j < BENCH_KEYWORDS; j++) {
+        snprintf(names[j], sizeof(names[j]), ((j % 4) ? "kw%d" : "type%d|"), j);
+        many[j] = names[j];
+    }
+    many[BENCH_KEYWORDS] = NULL;
+
+    printf("keywords: %d MB of words, a third of them keywords\n",
+        (BENCH_KEYWORD_TEXT / (1024 * 1024)));
+    char** tables[] = { C_HL_keywords, many };
+    int sizes[] = { nc, BENCH_KEYWORDS };
+    for (int t = 0; t < 2; t++) {
+        char* text = benchGenerateWords(tables[t], sizes[t], BENCH_KEYWORD_TEXT);
+        struct keywordTable kt = { NULL, 0, NULL, 0, 0 };
+        editorKeywordsCompile(&kt, tables[t]);
+        for (int m = 0; m < 2; m++) {
+            double best = 0;
+            int found = 0;
+            for (int r = 0; r < BENCH_REPEAT; r++) {
+                found = 0;
+                double start = benchNow();
+                int prev_sep = 1;
+                for (int i = 0; i < BENCH_KEYWORD_TEXT;) {
+                    int len;
+                    if (prev_sep && (m ?
+                        editorKeywordFind(&kt, &text[i], &len) :
+                        benchKeywordLinear(tables[t], &text[i], &len)) != HL_NORMAL) {
+                        found++;
+                        i += len;
+                        prev_sep = 0;
+                        continue;
+                    }
+                    prev_sep = benchIsSeparator(text[i]);
+                    i++;
+                }
+                double time = benchNow() - start;
+                if ((r == 0) || (time < best)) {
+                    best = time;
+                }
+            }
+            printf("  %3d keywords %-6s: %7.1f MB/s (%d keywords)\n", sizes[t],
+                (m ? "hash" : "linear"), (BENCH_KEYWORD_TEXT / best / 1e6), found);
+        }
+        editorKeywordsFree(&kt);
+        free(text);
+    }
+}
+
+// Measure the throughput of lexing rows of C code, testing every rule at each
+// character against the table-driven lexer
+void benchLex(void) {
+    E.screenrows = BENCH_DRAW_ROWS - 2;
+    E.screencols = BENCH_DRAW_COLS;
+    editorScreenInit();
+    benchOpenSource(BENCH_LEX_LINES);
+
+    // The rows are lexed from one text, each of them ends at a NUL
+    size_t size = 0;
+    for (int r = 0; r < E.numrows; r++) {
+        size += editorRowAt(r)->size + 1;
+    }
+    char* text = malloc(size);
+    unsigned char* hls[2] = { malloc(size), malloc(size) };
+    if ((text == NULL) || (hls[0] == NULL) || (hls[1] == NULL)) {
+        die("malloc");
+    }
+    size_t len = 0;
+    for (int r = 0; r < E.numrows; r++) {
+        erow* row = editorRowAt(r);
+        len += editorRowCopy(row, 0, row->size, &text[len]);
+        text[len++] = '\0';
+    }
+
+    printf("lexer: %d lines of C code (%zu KB)\n", E.numrows, (size / 1024));
+    const char* names[] = { "chained", "table" };
+    double times[2];
+    for (int m = 0; m < 2; m++) {
+        double best = 0;
+        for (int r = 0; r < BENCH_REPEAT; r++) {
+            memset(hls[m], HL_NORMAL, size);
+            double start = benchNow();
+            int in_comment = 0;
+            for (size_t i = 0; i < size;) {
+                int n = strlen(&text[i]);
+                struct lexState st = { 1, 0, in_comment, 0, 0 };
+                if (m == 0) {
+                    benchLexSpanChained(&text[i], 0, n, n, &hls[m][i], &st);
+                } else {
+                    editorLexSpan(&text[i], 0, n, n, &hls[m][i], &st);
+                }
+                in_comment = st.in_comment;
+                i += n + 1;
+            }
+            double t = benchNow() - start;
+            if ((r == 0) || (t < best)) {
+                best = t;
+            }
+        }
+        times[m] = best;
+        printf("  %-8s: %7.1f MB/s, %5.1fx\n", names[m], (size / best / 1e6),
+            (times[0] / best));
+    }
+    printf("  highlighting %s\n", memcmp(hls[0], hls[1], size) ? "DIFFERS" : "matches");
+
+    free(text);
+    free(hls[0]);
+    free(hls[1]);
+}
+
+// Measure the throughput of the newline indexers
+void benchNewline(const size_t mb) {
+    const size_t size = mb * 1024 * 1024;
+    const int linelens[] = { 8, 80, 1000 };
+
+    printf("newline indexer: %zu MB per file\n", mb);
+    for (unsigned int l = 0; l < (sizeof(linelens) / sizeof(linelens[0])); l++) {
+        for (int crlf = 0; crlf <= 1; crlf++) {
+            char* buf = benchGenerateFile(size, linelens[l], crlf);
+            struct lineIndex idx = { NULL, 0, 0, 0 };
+
+            for (unsigned int i = 0; i < INDEXERS_ENTRIES; i++) {
+                if (INDEXERS[i].supported && !INDEXERS[i].supported()) {
+                    continue;
+                }
+                double best = 0;
+                for (int r = 0; r < BENCH_REPEAT; r++) {
+                    idx.n = 0;
+                    idx.crlf = 0;
+                    double start = benchNow();
+                    INDEXERS[i].index(buf, 0, size, &idx);
+                    double t = benchNow() - start;
+                    if ((r == 0) || (t < best)) {
+                        best = t;
+                    }
+                }
+                printf("  line %4d %-4s %-6s: %6.2f GB/s (%d lines, %d CRLF)\n",
+                    linelens[l], (crlf ? "crlf" : "lf"), INDEXERS[i].name,
+                    (size / best / 1e9), idx.n, idx.crlf);
+            }
+
+            printf("  line %4d %-4s chosen: %s\n", linelens[l], (crlf ? "crlf" : "lf"),
+                editorLineIndexer(buf, size)->name);
+
+            free(idx.starts);
+            munmap(buf, size);
+        }
+    }
+}
+
+/*** init ***/
+
+int main(int argc, char* argv[]) {
+    const char* name = (argc >= 2) ? argv[1] : "all";
+    size_t mb = (argc >= 3) ? strtoul(argv[2], NULL, 10) : 256;
+
+    if (!strcmp(name, "newline") || !strcmp(name, "all")) {
+        benchNewline(mb);
+    }
+    if (!strcmp(name, "draw") || !strcmp(name, "all")) {
+        benchDraw();
+    }
+    if (!strcmp(name, "keywords") || !strcmp(name, "all")) {
+        benchKeywords();
+    }
+    if (!strcmp(name, "lex") || !strcmp(name, "all")) {
+        benchLex();
+    }
+
+    return 0;
+}
@@ -1,6 +1,6 @@
 /*** includes ***/
 
-// Feature test macro for getline()
+// Feature test macros
 #define _DEFAULT_SOURCE
 #define _BSD_SOURCE
 #define _GNU_SOURCE
@@ -8,21 +8,60 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 /*** defines ***/
 
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+#define KILO_ADD_BLOCK_SIZE (64 * 1024) // Size of an append buffer block
+#define KILO_ROW_FANOUT 64 // Maximum entries in a node of the row tree
+#define KILO_ROW_MARK 256 // Characters between checkpoints of the column mapping
+#define KILO_LONG_LINE (1024 * 1024) // Rows longer than this render only a window around the view
+#define KILO_LONG_WINDOW (4 * 1024) // Cells rendered on each side of the view of a long row
+#define KILO_LEX_CHUNK (16 * 1024) // Characters between saved lexer states of a long row
+#define KILO_LEX_LOOKAHEAD 64 // Characters the lexer may look ahead of its position
+#define KILO_HL_MARK 1024 // Rows between saved states of multi-line comments
+#define KILO_SOFT_WRAP 0 // 1 to start with rows wrapped at the screen width (toggled by Ctrl-W)
+#define KILO_RENDER_CACHE 4096 // Maximum rows keeping the render and the highlighting
+#define KILO_DIFF_RENDER 1 // 0 to repaint the whole screen on every frame
+#define KILO_DIFF_GAP 6 // Unchanged cells drawn over rather than moving the cursor
+#define KILO_CELL_BYTES 4 // Bytes kept for each screen cell in rows of non-ASCII text
+#define KILO_HW_SCROLL 1 // 0 to draw the rows scrolled into view without scrolling the terminal
+#define KILO_SYNC_OUTPUT 1 // 0 not to wrap frames in synchronized updates
+#define KILO_FRAME_BUDGET_MS 16 // Frames taking longer than this degrade the next ones
+#define KILO_IDLE_MS 300 // Time without keys before degraded frames are drawn in full
+#define KILO_HL_THREAD 1 // 0 to highlight edited rows on the main thread
+#define KILO_ATOMIC_SAVE 1 // 1 to flush the saved file to the disk before it replaces the old one
+#define KILO_SAVE_IOV 1024 // iovecs written at a time (IOV_MAX of Linux)
+#define KILO_LOAD_ASYNC (16 * 1024 * 1024) // Files larger than this are loaded in the background
+#define KILO_LOAD_CHUNK (4 * 1024 * 1024) // Bytes indexed by the loader at a time
+#define KILO_INDEX_SAMPLE (256 * 1024) // Bytes each newline indexer is timed on to choose one
+#define KILO_LOAD_SLICE_MS 20 // Time to add loaded rows before checking keys
+#define KILO_ARENA_SLAB (1024 * 1024) // Size of a slab of the arena
+#define KILO_ARENA_MIN 32 // Smallest size class of the arena
+#define KILO_ARENA_MAX (64 * 1024) // Largest size class of the arena
+#define KILO_ARENA_CLASSES 23 // The number of size classes (32 B - 64 KB)
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -60,10 +99,27 @@ enum editorHighlight {
     HL_MATCH
 };
 
+// Attributes of screen cells: the highlighting value and the inverse flag
+enum screenAttr {
+    ATTR_DEFAULT = HL_NORMAL,
+    ATTR_INVERSE = 0x80
+};
+
 // Flag bit for type of highlighting
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
+// Bits of the character classes of the lexer
+enum lexClass {
+    LEX_SEPARATOR = (1 << 0), // Separator between words
+    LEX_DIGIT = (1 << 1), // Digit of a number
+    LEX_DOT = (1 << 2), // Decimal point continuing a number
+    LEX_QUOTE = (1 << 3), // Quote of a string
+    LEX_SCS = (1 << 4), // First character of the start of a single-line comment
+    LEX_MCS = (1 << 5), // First character of the start of a multi-line comment
+    LEX_MCE = (1 << 6) // First character of the end of a multi-line comment
+};
+
 /*** data ***/
 
 // Syntax highlighting info by a filetype
@@ -77,17 +133,299 @@ struct editorSyntax {
     int flags; // Bit field for highlighting definition
 };
 
+// Keyword in a slot of the keyword table
+struct keywordSlot {
+    const char* word; // Keyword, NULL if the slot is empty
+    int len; // Length without the flag of the secondary keywords
+    unsigned char hl; // Highlighting of the keyword
+};
+
+// Keywords of the syntax compiled into a perfect hash table: the hash of a word
+// picks a bucket, and the seed of the bucket hashes its keywords to free slots
+struct keywordTable {
+    unsigned int* seeds; // Seed of each bucket
+    int nbuckets; // The number of buckets, a power of 2
+    struct keywordSlot* slots; // Slots of the keywords
+    int nslots; // The number of slots, a power of 2 or 0 without keywords
+    int maxlen; // Length of the longest keyword
+};
+
+// Lexer compiled from a syntax: the class of each character decides which
+// rule of the current state may apply there, without testing each rule
+struct lexTable {
+    unsigned char cls[256]; // LEX_* bits of the characters
+    const char* scs; // Start of single-line comments
+    const char* mcs; // Start of multi-line comments
+    const char* mce; // End of multi-line comments
+    int scs_len; // Length of the start of single-line comments, 0 without them
+    int mcs_len; // Length of the delimiters of multi-line comments,
+    int mce_len; // 0 without them
+};
+
+// Span of text in the original file or the append buffer
+struct piece {
+    const char* text; // Start of the span
+    int len; // Length of the span
+};
+
+// Checkpoint of the column mapping at a character of a row
+struct rowMark {
+    int rx; // Rendering index of the character
+    int k; // Piece holding the character
+    int off; // Offset of the character in the piece
+};
+
+// Range of Unicode code points
+struct codeRange {
+    int first;
+    int last;
+};
+
+// State of the lexer between characters of a row
+struct lexState {
+    int prev_sep; // 1 when the previous character is a separator
+    int in_string; // '"' or '\'' while parsing string
+    int in_comment; // 1 while parsing multi-line comment
+    int line_comment; // 1 after the start of a single-line comment
+    int number; // 1 when the previous character is a part of a number
+};
+
+// Lexer state saved at a chunk boundary of a long row
+struct lexCheckpoint {
+    int at; // Boundary of the chunk
+    int cx; // Position where the lexer passed the boundary (-1 until lexed)
+    struct lexState st; // State there
+};
+
+// Block of the append buffer, never moved once allocated
+struct addBlock {
+    struct addBlock* prev; // Previously filled block
+    int used; // Used bytes
+    int cap; // Capacity
+    char data[]; // Appended characters
+};
+
+// Piece-table storage, rows are lists of pieces into these buffers
+struct textBuffer {
+    char* orig; // Original file contents
+    size_t orig_len; // Length of the original contents
+    int orig_mapped; // 1 when the original contents are mapped from the file
+    struct addBlock* add; // Append buffer (the block being filled)
+};
+
+// Slab of the arena, cut into slots of the size classes
+struct arenaSlab {
+    struct arenaSlab* prev; // Previously filled slab
+    char data[]; // Slots
+};
+
+// Allocation larger than the size classes
+struct arenaLarge {
+    struct arenaLarge* prev; // Adjacent large allocations
+    struct arenaLarge* next;
+    char data[]; // Allocated memory
+};
+
+// Size-class allocator released at once when the buffer is closed
+struct arena {
+    const char* name; // Name shown in the statistics
+    struct arenaSlab* slabs; // Slabs (the one being cut first)
+    char* bump; // Next slot of the current slab
+    size_t left; // Bytes left in the current slab
+    void* free[KILO_ARENA_CLASSES]; // Lists of freed slots by the size class
+    struct arenaLarge* large; // Large allocations
+    // Statistics
+    size_t live[KILO_ARENA_CLASSES]; // Slots in use by the size class
+    size_t nslabs; // The number of slabs
+    size_t nlarge; // The number of large allocations
+    size_t large_bytes; // Bytes of large allocations
+    size_t allocs; // The number of allocations
+    size_t frees; // The number of frees
+    size_t reused; // Allocations served from the lists of freed slots
+    size_t in_place; // Reallocations which stayed in the slot
+    size_t moved; // Reallocations which moved to a larger slot
+};
+
+// Index of line starts in a buffer
+struct lineIndex {
+    size_t* starts; // Offsets of line starts, followed by the end of the last line + 1
+    int n; // The number of lines
+    int cap; // Capacity of the offsets
+    int crlf; // The number of lines ending with CRLF
+};
+
+// Loader streaming the lines of a mapped file into rows in the background
+struct loader {
+    int active; // 1 while the file is being loaded
+    pthread_t thread; // Thread indexing the lines
+    pthread_mutex_t lock; // Lock of the members shared with the thread
+    int notify[2]; // Pipe to wake up the main loop when lines are indexed
+    const char* buf; // Contents being loaded
+    size_t len; // Length of the contents
+    // Shared with the thread
+    struct lineIndex ready; // Line starts indexed but not taken yet
+    int finished; // 1 when the whole contents are indexed
+    int cancel; // 1 to stop the thread
+    // Owned by the main thread
+    struct lineIndex queue; // Line starts taken from the thread
+    int next; // Next entry of the queue
+    int last; // 1 when the queue holds the last lines
+    size_t start; // Start of the next row
+};
+
+// Saver writing a snapshot of the rows to the file in the background
+struct saver {
+    int active; // 1 while the file is being saved
+    pthread_t thread; // Thread writing the file
+    int notify[2]; // Pipe to wake up the main loop when the file is saved
+    char* filename; // File name to be saved
+    mode_t mode; // Permissions of the file
+    struct iovec* iov; // Snapshot of the rows
+    int niov; // The number of iovecs
+    size_t len; // Length of the contents
+    int dirty; // Dirty flag when the snapshot is taken
+    // Results of the thread
+    int fd; // Descriptor of the saved file (-1 on failure)
+    int error; // errno of the failure
+    int sync_error; // errno of flushing the directory after the file replaced the old one
+    double write_sec; // Time to write the contents
+    double fsync_sec; // Time to flush the file and the directory
+};
+
+// Row of a job of the highlighter
+struct hlRow {
+    int end; // End of the characters in the text of the job
+    unsigned int ver; // Version of the row when the job is given
+    int out; // State after the row before the job, the lexed one after it
+    int pending; // 1 if the row waits for the highlighter
+};
+
+// Highlighter lexing rows on the screen in the background,
+// they are drawn with their old highlighting until the results arrive
+struct highlighter {
+    int active; // 1 when the thread is running
+    pthread_t thread; // Thread lexing the rows
+    pthread_mutex_t lock; // Lock of the job shared with the thread
+    pthread_cond_t cond; // Signaled when a job is given or done
+    int notify[2]; // Pipe to wake up the main loop when a job is done
+    int busy; // 1 while the thread lexes the job
+    int given; // 1 from giving a job until its results are taken
+    // Job, a snapshot of the rows from the first one
+    unsigned int gen; // Generation of the syntax
+    int first; // Index of the first row
+    int in_comment; // State before the first row
+    struct hlRow* rows; // Rows of the job
+    int n; // The number of rows
+    int rowcap; // Capacity of the rows
+    char* text; // Characters of the rows, each of them ends with '\0'
+    unsigned char* hl; // Highlighting of the renders lexed by the thread
+    size_t cap; // Capacity of the text and the highlighting
+    int lexed; // The number of rows lexed by the thread
+    // Statistics
+    size_t jobs; // Jobs given
+    size_t applied; // Rows taking the results
+    size_t dropped; // Rows whose results are dropped since they changed
+};
+
+// Grid of screen cells
+struct screenGrid {
+    char* chars; // Characters of the cells
+    unsigned char* attrs; // Attributes of the cells
+    unsigned char* multibyte; // 1 for rows having non-ASCII bytes
+};
+
+// Model of the screen for the differential rendering
+struct screen {
+    int rows; // The number of rows including the status and the message bar
+    int cols; // The number of columns
+    int stride; // Bytes of a row of the grids, rows of non-ASCII text may go
+                // beyond the columns
+    struct screenGrid front; // Cells shown on the terminal
+    struct screenGrid back; // Cells of the frame being drawn
+    int valid; // 1 when the front matches the terminal
+    int rowoff, coloff; // Offsets of the text shown in the front (rowoff in
+                        // screen lines when the rows are wrapped)
+    int sync; // 1 when the terminal supports the synchronized output
+    int degraded; // 1 when rows not highlighted yet are drawn as plain text
+    char* plain; // Cells and characters of a row drawn as plain text
+    int* plainmap; // Offsets of the columns in the cells drawn as plain text
+    unsigned char style[256]; // First attribute drawn the same as each attribute
+    struct {
+        char seq[12];
+        int len;
+    } sgr[256]; // Escape sequences setting the attributes
+    // Statistics
+    size_t frames; // The number of frames
+    size_t full_frames; // The number of frames repainting the whole screen
+    size_t scrolls; // The number of frames scrolling the terminal
+    size_t skipped; // The number of frames skipped for pending keys
+    size_t degrades; // The number of times the frames are degraded
+    double last_ms; // Time to draw the last frame
+    size_t keys; // The number of keys read
+    size_t bytes; // Bytes written by all the frames
+    size_t last_bytes; // Bytes written by the last frame
+    size_t grows; // Reallocations of the frame buffer
+    size_t last_grows; // Reallocations of the frame buffer by the last frame
+    int capacity; // Capacity of the frame buffer
+};
+
 // Editor row
 typedef struct erow {
-    int idx; // Row index
+    struct rowNode* leaf; // Leaf of the row tree holding the row
     int size; // Row size
-    int rsize; // Rendering size
-    char* chars; // Characters in the row
-    char* render; // Rendering characters
+    int rsize; // Rendering size in columns
+    int rcap; // Capacity of the render and the highlighting
+    int npieces; // The number of pieces
+    int piececap; // Capacity of the piece list
+    struct piece* pieces; // Characters in the row as a piece list
+    struct rowMark* marks; // Checkpoints at every KILO_ROW_MARK characters from the first one
+    int nmarks; // The number of valid checkpoints
+    int markcap; // Capacity of the checkpoints
+    char* render; // Rendering characters (NULL until the row is materialized)
     unsigned char* hl; // Highlighting
+    int* cmap; // Render offsets of the columns (NULL when the render is ASCII)
+    int cmapcap; // Capacity of the column map
+    int windowed; // 1 when the render holds only a window of the cells (long rows)
+    int wrx; // Rendering index of the first cell in the render
+    int wlen; // Columns in the window (0 when it's stale)
+    struct lexCheckpoint* lex; // Saved lexer states of a long row
+    int nlex; // The number of the saved states
+    int lexcap; // Capacity of the saved states
+    int lexvalid; // The number of leading saved states still valid
+    int lexsame; // Last edited position, states after it are of the same text
+    int lexin; // Comment state at the start of the row when it's lexed
     int hl_open_comment; // Is part of unclosed multi-line comment?
+    int lines; // Screen lines of the row when it's wrapped (estimated until rendered)
+    unsigned int hl_gen; // Generation of the syntax when the row is highlighted
+    int hl_pending; // 1 while the row waits for the highlighter, showing its old highlighting
+    unsigned int hl_ver; // Version of the render and the highlighting
+    struct erow* lru_prev; // Adjacent rows in the render cache
+    struct erow* lru_next;
 } erow;
 
+// Rows keeping the render and the highlighting, in the recently used order
+struct renderCache {
+    erow* head; // Most recently used row
+    erow* tail; // Least recently used row
+    int n; // The number of rows
+    size_t evicted; // The number of rows evicted
+};
+
+// Node of the row tree, a B+tree counting rows in each subtree
+struct rowNode {
+    struct rowNode* parent; // Parent node (NULL for the root)
+    struct rowNode* prev; // Adjacent leaves (only for leaves)
+    struct rowNode* next;
+    int leaf; // 1 when the entries are rows
+    int n; // The number of entries
+    int count; // The number of rows in the subtree
+    int lines; // Screen lines of the rows in the subtree when they are wrapped
+    union {
+        struct rowNode* child[KILO_ROW_FANOUT];
+        erow* row[KILO_ROW_FANOUT];
+    } e; // Entries
+};
+
 // Editor configuration
 struct editorConfig {
     int cx, cy; // Cursor position
@@ -97,13 +435,37 @@ struct editorConfig {
     int screenrows; // The number of rows of the screen
     int screencols; // The number of columns of the screen
     int numrows; // The number of rows
-    erow* row; // Editor rows
+    int wrap; // 1 when the rows are wrapped at the screen width
+    int lineoff; // Screen line offset when the rows are wrapped
+    int cline; // Screen line of the cursor when the rows are wrapped
+    struct rowNode* rowtree; // Editor rows
+    struct arena rowarena; // Storage of rows and their buffers
+    struct renderCache cache; // Rows having the render
+    unsigned int hl_gen; // Generation of the syntax, rows of the others are stale
+    int hl_stale; // First row whose multi-line comment state may be outdated, INT_MAX if none
+    int* hl_stales; // First rows of the regions whose states may be outdated, sorted
+    int hl_nstales; // The number of the regions, the first one starts at hl_stale
+    int hl_stalecap; // Capacity of the regions
+    unsigned char* hl_marks; // Multi-line comment state before every KILO_HL_MARK rows
+    int hl_nmarks; // The number of the states valid from the first row
+    int hl_markcap; // Capacity of the states
+    struct textBuffer tb; // Text storage of the rows
+    struct loader loader; // Loader of the file
+    struct saver saver; // Saver of the file
+    struct highlighter highlighter; // Highlighter of the rows edited on the screen
+    unsigned int hl_ver; // Last version given to a render and its highlighting
+    struct screen screen; // Screen model
     int dirty; // Dirty flag
     char* filename; // File name
     char statusmsg[80]; // Status message
     time_t statusmsg_time; // Timestamp when status message is updated
     struct editorSyntax* syntax; // Syntax highlighting info
+    struct keywordTable keywords; // Keywords of the syntax compiled for lookup
+    struct lexTable lexer; // Lexer compiled from the syntax
     struct termios orig_termios; // Original configuration
+    char typed[64]; // Keys typed while the terminal was asked something, read before stdin
+    int ntyped; // The number of the keys typed
+    int typedpos; // Next key typed to be read
 };
 
 static struct editorConfig E;
@@ -140,7 +502,19 @@ struct editorSyntax HLDB[] = {
 /*** prototypes ***/
 
 void editorSetStatusMessage(const char* fmt, ...);
+void editorRowMaterialize(erow* row);
+void editorUpdateRow(erow* row);
+void editorRowLex(erow* row, struct lexState* st);
+int editorRowRenderAt(const erow* row, const int col);
+int editorRowCopy(erow* row, const int cx, int len, char* buf);
+int editorRenderChars(const char* text, const int len, const int rx, const int limit,
+    char* render, const unsigned char* hl, unsigned char* rhl, int* cmap);
+char* editorLexScratch(const int len, unsigned char** hl);
 void editorRefreshScreen(void);
+void editorWaitKey(void);
+int editorLoaderAllows(const int at);
+void editorHighlighterWait(void);
+double editorElapsed(const struct timespec* since);
 char* editorPrompt(char* prompt, void (*callback)(char*, int));
 
 /*** terminal ***/
@@ -204,11 +578,40 @@ void enableRawMode(void) {
     }
 }
 
+// Keep bytes read from stdin that don't belong to a reply of the terminal
+void editorKeepTyped(const char* bytes, int len) {
+    for (int i = 0; (i < len) && (E.ntyped < (int)sizeof(E.typed)); i++) {
+        E.typed[E.ntyped++] = bytes[i];
+    }
+}
+
+// Return 1 if keys typed earlier are still to be read
+int editorTypedPending(void) {
+    return E.typedpos < E.ntyped;
+}
+
+// Read a byte of the input, the keys typed earlier come first
+int editorReadByte(char* c) {
+    if (editorTypedPending()) {
+        *c = E.typed[E.typedpos++];
+        if (E.typedpos == E.ntyped) {
+            E.ntyped = 0;
+            E.typedpos = 0;
+        }
+        return 1;
+    }
+    return read(STDIN_FILENO, c, 1);
+}
+
 // Read a pressed key and return the key value
 int editorReadKey(void) {
+    // Jobs in the background go on until a key is pressed
+    editorWaitKey();
+    E.screen.keys++;
+
     int nread;
     char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+    while ((nread = editorReadByte(&c)) != 1) {
         if ((nread == -1) && (errno != EAGAIN)) {
             die("read");
         }
@@ -218,16 +621,16 @@ int editorReadKey(void) {
     if (c == '\x1b') {
         char seq[3];
         // Return when preceding bytes can't be read
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) {
+        if (editorReadByte(&seq[0]) != 1) {
             return '\x1b';
         }
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) {
+        if (editorReadByte(&seq[1]) != 1) {
             return '\x1b';
         }
 
         if (seq[0] == '[') {
             if ((seq[1] >= '0') && (seq[1] <= '9')) {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) {
+                if (editorReadByte(&seq[2]) != 1) {
                     return '\x1b';
                 }
                 // "<ESC>[0" - "<ESC>[9"
@@ -267,7 +670,8 @@ int editorReadKey(void) {
 
         return '\x1b';
     } else {
-        return c;
+        // Bytes of UTF-8 characters are returned as they are
+        return (unsigned char)c;
     }
 }
 
@@ -304,6 +708,60 @@ int getCursorPosition(int* rows, int* cols) {
     return -1;
 }
 
+// Ask if the terminal supports the synchronized output (DEC private mode 2026)
+int getSynchronizedOutput(void) {
+    // "<ESC>[?2026$p": request the state of the mode (DECRQM)
+    // "<ESC>[c": request the device attributes, every terminal replies to it
+    // so the reply ends waiting for the former one
+    if (write(STDOUT_FILENO, "\x1b[?2026$p\x1b[c", 13) != 13) {
+        return 0;
+    }
+
+    // Read the replies "<ESC>[?2026;<state>$y" and "<ESC>[?...c",
+    // both start with "<ESC>[?" which no key sends, the other bytes are
+    // keys typed in the meantime and kept for editorReadKey()
+    char seq[32];
+    int len = 0;
+    int state = 0;
+    while (1) {
+        char c;
+        if (read(STDIN_FILENO, &c, 1) != 1) {
+            break; // No more replies in time
+        }
+        if ((len < 3) && (c != "\x1b[?"[len])) {
+            // Not a reply, a new one may start at an <ESC> typed after others
+            editorKeepTyped(seq, len);
+            len = 0;
+            if (c != '\x1b') {
+                editorKeepTyped(&c, 1);
+                continue;
+            }
+        }
+        if (len == (int)sizeof(seq) - 1) {
+            len = 0; // Too long for a reply
+            continue;
+        }
+        seq[len++] = c;
+        if ((len <= 3) || (c < 0x40) || (c > 0x7e)) {
+            continue;
+        }
+
+        // A final byte ends the reply
+        seq[len] = '\0';
+        len = 0;
+        if (c == 'c') {
+            break;
+        }
+        if ((c == 'y') && (strncmp(seq, "\x1b[?2026;", 8) == 0)) {
+            sscanf(&seq[8], "%d", &state);
+        }
+    }
+    editorKeepTyped(seq, len);
+
+    // The state is 1 (set) or 2 (reset) for a supported mode
+    return (state == 1) || (state == 2);
+}
+
 // Get window size
 int getWindowSize(int* rows, int* cols) {
     struct winsize ws;
@@ -322,371 +780,2404 @@ int getWindowSize(int* rows, int* cols) {
     }
 }
 
-/*** syntax highlighting ***/
+/*** arena ***/
 
-// Check the character is a separator character
-int is_separator(int c) {
-    return isspace(c) || (c == '\0') || (strchr(",.()+-/*=~%<>[];", c) != NULL);
+// Get the size class of the allocation size and the capacity of its slot,
+// classes grow by 1.5x and 2x in turn: 32, 48, 64, 96, 128, ...
+int editorArenaClass(const size_t size, size_t* cap) {
+    int cls = 0;
+    *cap = KILO_ARENA_MIN;
+    while (*cap < size) {
+        *cap = (cls % 2) ? (*cap / 3 * 4) : (*cap / 2 * 3);
+        cls++;
+    }
+    return cls;
 }
 
-// Update syntax values of the row
-void editorUpdateSyntax(erow* row) {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
-
-    if (E.syntax == NULL) {
-        return;
+// Get the capacity of the slot for the allocation size
+size_t editorArenaCapacity(const size_t size) {
+    size_t cap = size;
+    if (size <= KILO_ARENA_MAX) {
+        editorArenaClass(size, &cap);
     }
+    return cap;
+}
 
-    char** keywords = E.syntax->keywords;
-
-    char* scs = E.syntax->singleline_comment_start;
-    char* mcs = E.syntax->multiline_comment_start;
-    char* mce = E.syntax->multiline_comment_end;
-
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
-
-    int prev_sep = 1; // 1 when the previous character is a separator
-    int in_string = 0; // '"' or '\'' while parsing string
-    // 1 while parsing  comment
-    int in_comment = ((row->idx > 0) && E.row[row->idx - 1].hl_open_comment);
-
-    int i = 0;
-    while (i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+// Allocate memory from the arena
+void* editorArenaAlloc(struct arena* a, const size_t size) {
+    a->allocs++;
 
-        // Single-line comment
-        if (scs_len && !in_string && !in_comment) {
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, (row->rsize - i));
-                break;
-            }
+    if (size > KILO_ARENA_MAX) {
+        // Large allocations are linked to be released with the arena
+        struct arenaLarge* large = malloc(sizeof(struct arenaLarge) + size);
+        if (large == NULL) {
+            die("malloc");
         }
-
-        // Multi-line comment
-        if (mcs_len && mce_len && !in_string) {
-            if (in_comment) {
-                row->hl[i] = HL_MLCOMMENT;
-                // Highlight to the end of the comment
-                if (!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
-                    continue;
-                } else {
-                    i++;
-                    continue;
-                }
-            } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-                // Highlight the start of the comment
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
-                continue;
-            }
+        large->prev = NULL;
+        large->next = a->large;
+        if (a->large) {
+            a->large->prev = large;
         }
+        a->large = large;
+        a->large_bytes += size;
+        a->nlarge++;
+        return large->data;
+    }
 
-        // String
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-            if (in_string) {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && ((i + 1) < row->rsize)) {
-                    // Continue highlighing when an escaped quote is detected
-                    row->hl[i + 1] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
-                if (c == in_string) {
-                    // Same quote is detected, therefore
-                    // finish highlighting
-                    in_string = 0;
-                }
-                i++;
-                prev_sep = 1; // Set 1 to prepare the end of the string
-                continue;
-            } else {
-                if ((c == '"') || (c == '\'')) {
-                    in_string = c;
-                    row->hl[i] = HL_STRING;
-                    i++;
-                    continue;
-                }
-            }
-        }
+    size_t cap;
+    int cls = editorArenaClass(size, &cap);
+    a->live[cls]++;
+    if (a->free[cls]) {
+        // Reuse a freed slot of the same class
+        void* p = a->free[cls];
+        a->free[cls] = *(void**)p;
+        a->reused++;
+        return p;
+    }
 
-        // Number
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if ((isdigit(c) && (prev_sep || (prev_hl == HL_NUMBER))) ||
-                ((c == '.') && (prev_hl == HL_NUMBER))) {
-                row->hl[i] = HL_NUMBER;
-                i++;
-                prev_sep = 0;
-                continue;
-            }
+    if (a->left < cap) {
+        // Start a new slab, the rest of the current one is left unused
+        struct arenaSlab* slab = malloc(sizeof(struct arenaSlab) + KILO_ARENA_SLAB);
+        if (slab == NULL) {
+            die("malloc");
         }
+        slab->prev = a->slabs;
+        a->slabs = slab;
+        a->bump = slab->data;
+        a->left = KILO_ARENA_SLAB;
+        a->nslabs++;
+    }
+    void* p = a->bump;
+    a->bump += cap;
+    a->left -= cap;
+    return p;
+}
 
-        // Keywords
-        if (prev_sep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                // Flag to change highlighting for the secondary keywords
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2) {
-                    klen--;
-                }
+// Return memory to the arena, the size is the one given on allocation
+void editorArenaFree(struct arena* a, void* p, const size_t size) {
+    if (p == NULL) {
+        return;
+    }
+    a->frees++;
 
-                // Detect <separator>+<keyword>+<separator>
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                    is_separator(row->render[i + klen])) {
-                    memset(&row->hl[i], (kw2 ? HL_KEYWORD2 : HL_KEYWORD1), klen);
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL) {
-                prev_sep = 0;
-                continue;
-            }
+    if (size > KILO_ARENA_MAX) {
+        struct arenaLarge* large = (struct arenaLarge*)((char*)p - offsetof(struct arenaLarge, data));
+        if (large->prev) {
+            large->prev->next = large->next;
+        } else {
+            a->large = large->next;
         }
-
-        prev_sep = is_separator(c);
-        i++;
+        if (large->next) {
+            large->next->prev = large->prev;
+        }
+        a->large_bytes -= size;
+        a->nlarge--;
+        free(large);
+        return;
     }
 
-    // Update the highlighing when the use changed a line as a comment
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && ((row->idx + 1) < E.numrows)) {
-        editorUpdateSyntax(&E.row[row->idx + 1]);
-    }
+    size_t cap;
+    int cls = editorArenaClass(size, &cap);
+    a->live[cls]--;
+    *(void**)p = a->free[cls];
+    a->free[cls] = p;
 }
 
-// Return corresponding ANSI color code for each syntax value
-int editorSyntaxToColor(int hl) {
-    switch (hl) {
-        case HL_COMMENT:
-        case HL_MLCOMMENT: return 36; // Foreground cyan
-        case HL_KEYWORD1: return 33; // Foreground yellow
-        case HL_KEYWORD2: return 32; // Foreground green
-        case HL_STRING: return 35; // Foreground magenta
-        case HL_NUMBER: return 31; // Foreground red
-        case HL_MATCH: return 34; // Foreground blue
-        default: return 37; // Foreground white
+// Resize memory of the arena, it stays in place while it fits in the slot
+void* editorArenaRealloc(struct arena* a, void* p, const size_t oldsize,
+    const size_t size) {
+    if (p == NULL) {
+        return editorArenaAlloc(a, size);
     }
+    if ((oldsize <= KILO_ARENA_MAX) && (size <= editorArenaCapacity(oldsize))) {
+        a->in_place++;
+        return p;
+    }
+
+    void* new = editorArenaAlloc(a, size);
+    memcpy(new, p, ((oldsize < size) ? oldsize : size));
+    editorArenaFree(a, p, oldsize);
+    a->moved++;
+    return new;
 }
 
-// Get the highlighting info from the database
-void editorSelectSyntaxHighlight(void) {
-    E.syntax = NULL;
-    if (E.filename == NULL) {
-        return;
+// Count allocations in use and their bytes including the slack of the slots
+size_t editorArenaLive(const struct arena* a, size_t* bytes) {
+    size_t live = a->nlarge;
+    size_t cap = KILO_ARENA_MIN;
+    *bytes = a->large_bytes;
+    for (int cls = 0; cls < KILO_ARENA_CLASSES; cls++) {
+        live += a->live[cls];
+        *bytes += a->live[cls] * cap;
+        cap = (cls % 2) ? (cap / 3 * 4) : (cap / 2 * 3);
     }
+    return live;
+}
 
-    char* ext = strrchr(E.filename, '.');
+// Release every allocation of the arena at once
+void editorArenaRelease(struct arena* a) {
+    while (a->slabs) {
+        struct arenaSlab* prev = a->slabs->prev;
+        free(a->slabs);
+        a->slabs = prev;
+    }
+    while (a->large) {
+        struct arenaLarge* next = a->large->next;
+        free(a->large);
+        a->large = next;
+    }
 
-    // Search the extension from the database
-    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-        struct editorSyntax* s = &HLDB[j];
-        unsigned int i = 0;
-        while (s->filematch[i]) {
-            int is_ext = (s->filematch[i][0] == '.');
-            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-                (!is_ext && strstr(E.filename, s->filematch[i]))) {
-                E.syntax = s;
+    const char* name = a->name;
+    memset(a, 0, sizeof(struct arena));
+    a->name = name;
+}
 
-                // Update syntax highlighting for all rows
-                for (int filerow = 0; filerow < E.numrows; filerow++) {
-                    editorUpdateSyntax(&E.row[filerow]);
-                }
+/*** row tree ***/
+
+// Create an empty node of the row tree
+struct rowNode* editorRowNodeNew(const int leaf) {
+    struct rowNode* node = editorArenaAlloc(&E.rowarena, sizeof(struct rowNode));
+    node->parent = NULL;
+    node->prev = NULL;
+    node->next = NULL;
+    node->leaf = leaf;
+    node->n = 0;
+    node->count = 0;
+    node->lines = 0;
+    return node;
+}
 
-                return;
-            }
+// Get the row at the index
+erow* editorRowAt(int at) {
+    struct rowNode* node = E.rowtree;
+    while (!node->leaf) {
+        int i = 0;
+        while (at >= node->e.child[i]->count) {
+            at -= node->e.child[i]->count;
             i++;
         }
+        node = node->e.child[i];
     }
+    return node->e.row[at];
 }
 
-/*** row operations ***/
+// Get the index of the row from the counts of the preceding subtrees
+int editorRowIdx(const erow* row) {
+    struct rowNode* node = row->leaf;
+    int idx = 0;
+    while (node->e.row[idx] != row) {
+        idx++;
+    }
 
-// Convert character position X to rendering position
-int editorRowCxToRx(erow* row, const int cx) {
-    int rx = 0;
-    for (int j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t') {
-            rx += ((KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP));
+    while (node->parent) {
+        struct rowNode* parent = node->parent;
+        for (int i = 0; parent->e.child[i] != node; i++) {
+            idx += parent->e.child[i]->count;
         }
-        rx++;
+        node = parent;
     }
-    return rx;
+    return idx;
 }
 
-// Convert rendering position X to character position
-int editorRowRxToCx(erow *row, const int rx) {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t') {
-            cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-        }
-        cur_rx++;
+// Get the index of the row holding the screen line when the rows are wrapped,
+// the line is replaced with the one in the row (past the rows at the end)
+int editorRowAtLine(int* line) {
+    if (*line >= E.rowtree->lines) {
+        *line -= E.rowtree->lines;
+        return E.rowtree->count;
+    }
 
-        if (cur_rx > rx) {
-            return cx;
+    struct rowNode* node = E.rowtree;
+    int idx = 0;
+    while (!node->leaf) {
+        int i = 0;
+        while (*line >= node->e.child[i]->lines) {
+            *line -= node->e.child[i]->lines;
+            idx += node->e.child[i]->count;
+            i++;
         }
+        node = node->e.child[i];
     }
-    return cx;
+    int i = 0;
+    while (*line >= node->e.row[i]->lines) {
+        *line -= node->e.row[i]->lines;
+        i++;
+    }
+    return idx + i;
 }
 
-// Update the editor row
-void editorUpdateRow(erow* row) {
-    // Count tab
-    int tabs = 0;
-    for (int j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            tabs++;
-        }
+// Get the first screen line of the row from the lines of the preceding subtrees
+int editorRowLine(const erow* row) {
+    struct rowNode* node = row->leaf;
+    int line = 0;
+    for (int i = 0; node->e.row[i] != row; i++) {
+        line += node->e.row[i]->lines;
     }
 
-    free(row->render);
-    row->render = malloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
-
-    // Copy display characters to the render
-    int idx = 0;
-    for (int j = 0; j < row->size; j++) {
-        // Expand tab
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while ((idx % KILO_TAB_STOP) != 0) {
-                row->render[idx++] = ' ';
-            }
-        } else {
-            row->render[idx++] = row->chars[j];
+    while (node->parent) {
+        struct rowNode* parent = node->parent;
+        for (int i = 0; parent->e.child[i] != node; i++) {
+            line += parent->e.child[i]->lines;
         }
+        node = parent;
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
-
-    editorUpdateSyntax(row);
+    return line;
 }
 
-// Append characters to the editor row
-void editorInsertRow(const int at, char* s, const size_t len) {
-    if ((at < 0) || (at > E.numrows)) {
+// Set the screen lines of the row from its rendering size,
+// only the lines of the subtrees holding it are updated
+void editorRowSetLines(erow* row, const int rsize) {
+    // A line is left for the cursor after the last cell
+    int delta = (rsize / E.screencols) + 1 - row->lines;
+    if (delta == 0) {
         return;
     }
-
-    // Reallocate character row
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow)* (E.numrows - at));
-
-    // Update a row index
-    for (int j = (at + 1); j <= E.numrows; j++) {
-        E.row[j].idx++;
+    row->lines += delta;
+    for (struct rowNode* node = row->leaf; node; node = node->parent) {
+        node->lines += delta;
     }
+}
 
-    E.row[at].idx = at;
+// Get the first leaf, leaves are linked in the order of rows
+struct rowNode* editorRowFirstLeaf(void) {
+    struct rowNode* node = E.rowtree;
+    while (!node->leaf) {
+        node = node->e.child[0];
+    }
+    return node;
+}
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+// Move entries from the index to a new right sibling of the node
+struct rowNode* editorRowNodeSplit(struct rowNode* node, const int from) {
+    struct rowNode* right = editorRowNodeNew(node->leaf);
+    right->n = node->n - from;
+    memcpy(&right->e, &node->e.row[from], sizeof(void*) * right->n);
+    node->n = from;
+
+    for (int i = 0; i < right->n; i++) {
+        if (right->leaf) {
+            right->e.row[i]->leaf = right;
+            right->count++;
+            right->lines += right->e.row[i]->lines;
+        } else {
+            right->e.child[i]->parent = right;
+            right->count += right->e.child[i]->count;
+            right->lines += right->e.child[i]->lines;
+        }
+    }
+    node->count -= right->count;
+    node->lines -= right->lines;
+
+    if (node->leaf) {
+        right->prev = node;
+        right->next = node->next;
+        if (node->next) {
+            node->next->prev = right;
+        }
+        node->next = right;
+    }
+    return right;
+}
 
-    // Update rendering row
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+// Insert an entry to the node, return a new sibling when the node is split
+struct rowNode* editorRowNodeAdd(struct rowNode* node, const int i, void* entry,
+    const int append) {
+    struct rowNode* right = NULL;
+    struct rowNode* dest = node;
+    int at = i;
+    if (node->n == KILO_ROW_FANOUT) {
+        // Appending to the last row keeps nodes full for the sequential load
+        int from = append ? node->n : (node->n / 2);
+        right = editorRowNodeSplit(node, from);
+        if (i >= from) {
+            dest = right;
+            at = i - from;
+        }
+    }
 
-    E.numrows++;
-    E.dirty++;
+    memmove(&dest->e.row[at + 1], &dest->e.row[at], sizeof(void*) * (dest->n - at));
+    dest->n++;
+    if (dest->leaf) {
+        dest->e.row[at] = entry;
+        dest->e.row[at]->leaf = dest;
+    } else {
+        dest->e.child[at] = entry;
+        dest->e.child[at]->parent = dest;
+    }
+    return right;
 }
 
-// Free the editor row
-void editorFreeRow(erow* row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
-}
+// Insert the row to the subtree, return a new sibling when the node is split
+struct rowNode* editorRowNodeInsert(struct rowNode* node, int at, erow* row,
+    const int append) {
+    if (node->leaf) {
+        struct rowNode* right = editorRowNodeAdd(node, at, row, append);
+        if (right && (row->leaf == right)) {
+            right->count++;
+        } else {
+            node->count++;
+        }
+        return right;
+    }
 
-// Delete the editor row
-void editorDelRow(const int at) {
-    if ((at < 0) || (at >= E.numrows)) {
-        return;
+    int i = 0;
+    while ((i < (node->n - 1)) && (at > node->e.child[i]->count)) {
+        at -= node->e.child[i]->count;
+        i++;
+    }
+    struct rowNode* sibling = editorRowNodeInsert(node->e.child[i], at, row, append);
+    node->count++;
+    if (sibling == NULL) {
+        return NULL;
     }
 
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    // Update a row index
-    for (int j = at; j < (E.numrows - 1); j++) {
-        E.row[j].idx--;
+    struct rowNode* right = editorRowNodeAdd(node, (i + 1), sibling, append);
+    if (right && (sibling->parent == right)) {
+        right->count += sibling->count;
+        node->count -= sibling->count;
+        right->lines += sibling->lines;
+        node->lines -= sibling->lines;
     }
-    E.numrows--;
-    E.dirty++;
+    return right;
 }
 
-// Insert a character to the editor row
-void editorRowInsertChar(erow* row, int at, const int c) {
-    if ((at < 0) || (at > row->size)) {
-        at = row->size;
+// Insert the row to the tree at the index
+void editorRowTreeInsert(const int at, erow* row) {
+    int append = (at == E.rowtree->count);
+    struct rowNode* sibling = editorRowNodeInsert(E.rowtree, at, row, append);
+    if (sibling) {
+        // Grow the tree by a new root
+        struct rowNode* root = editorRowNodeNew(0);
+        editorRowNodeAdd(root, 0, E.rowtree, 0);
+        editorRowNodeAdd(root, 1, sibling, 0);
+        root->count = E.rowtree->count + sibling->count;
+        root->lines = E.rowtree->lines + sibling->lines;
+        E.rowtree = root;
     }
-    row->chars = realloc(row->chars, (row->size + 2));
-    // Copy string, safe for overwrapping of src/dest buffers
-    memmove(&row->chars[at + 1], &row->chars[at], (row->size - at + 1));
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
 }
 
-// Append a string to the editor row
-void editorRowAppendString(erow* row, char* s, const size_t len) {
-    row->chars = realloc(row->chars, (row->size + len + 1));
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
-}
+// Remove the row at the index from the tree and return it
+erow* editorRowTreeRemove(int at) {
+    struct rowNode* node = E.rowtree;
+    while (!node->leaf) {
+        int i = 0;
+        while (at >= node->e.child[i]->count) {
+            at -= node->e.child[i]->count;
+            i++;
+        }
+        node->count--;
+        node = node->e.child[i];
+    }
 
-// Delete a character from the editor row
-void editorRowDelChar(erow* row, const int at) {
-    if ((at < 0) || (at >= row->size)) {
-        return;
+    erow* row = node->e.row[at];
+    memmove(&node->e.row[at], &node->e.row[at + 1], sizeof(void*) * (node->n - at - 1));
+    node->n--;
+    node->count--;
+    for (struct rowNode* n = node; n; n = n->parent) {
+        n->lines -= row->lines;
     }
 
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
-}
+    // Merge an underfull leaf into the preceding leaf of the same parent
+    struct rowNode* prev = node->prev;
+    if ((node->n < (KILO_ROW_FANOUT / 4)) && prev && (prev->parent == node->parent) &&
+        ((prev->n + node->n) <= (KILO_ROW_FANOUT / 2))) {
+        for (int i = 0; i < node->n; i++) {
+            prev->e.row[prev->n++] = node->e.row[i];
+            node->e.row[i]->leaf = prev;
+        }
+        prev->count += node->count;
+        prev->lines += node->lines;
+        node->count = 0;
+        node->lines = 0;
+        node->n = 0;
+    }
+
+    // Unlink emptied nodes, underfull nodes are left as they are
+    while ((node->n == 0) && node->parent) {
+        struct rowNode* parent = node->parent;
+        int i = 0;
+        while (parent->e.child[i] != node) {
+            i++;
+        }
+        if (node->leaf) {
+            if (node->prev) {
+                node->prev->next = node->next;
+            }
+            if (node->next) {
+                node->next->prev = node->prev;
+            }
+        }
+        memmove(&parent->e.child[i], &parent->e.child[i + 1],
+            sizeof(void*) * (parent->n - i - 1));
+        parent->n--;
+        editorArenaFree(&E.rowarena, node, sizeof(struct rowNode));
+        node = parent;
+    }
+
+    // Shrink the tree while the root has a single child
+    while (!E.rowtree->leaf && (E.rowtree->n == 1)) {
+        struct rowNode* root = E.rowtree->e.child[0];
+        editorArenaFree(&E.rowarena, E.rowtree, sizeof(struct rowNode));
+        root->parent = NULL;
+        E.rowtree = root;
+    }
+    if (E.rowtree->n == 0) {
+        // Every leaf is removed, the root becomes the only leaf
+        E.rowtree->leaf = 1;
+    }
+    return row;
+}
+
+/*** syntax highlighting ***/
+
+// Separators between words: the characters of isspace(), '\0' and punctuations
+const unsigned char SEPARATORS[256] = {
+    ['\0'] = 1, [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1,
+    [','] = 1, ['.'] = 1, ['('] = 1, [')'] = 1, ['+'] = 1, ['-'] = 1, ['/'] = 1,
+    ['*'] = 1, ['='] = 1, ['~'] = 1, ['%'] = 1, ['<'] = 1, ['>'] = 1, ['['] = 1,
+    [']'] = 1, [';'] = 1,
+};
+
+// Hash the word with the seed (FNV-1a followed by a finalizer)
+unsigned int editorKeywordHash(const char* s, const int len, const unsigned int seed) {
+    unsigned int h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    h ^= h >> 15;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+// Find a seed of the bucket hashing its keywords to distinct free slots
+// and fill them, return 0 if there's no such seed
+int editorKeywordsPlace(struct keywordTable* kt, const int b,
+    const struct keywordSlot* keys, const int n) {
+    unsigned int mask = kt->nslots - 1;
+    for (unsigned int seed = 1; seed < (1u << 16); seed++) {
+        int j;
+        for (j = 0; j < n; j++) {
+            struct keywordSlot* k = &kt->slots[editorKeywordHash(keys[j].word,
+                keys[j].len, seed) & mask];
+            if (k->word) {
+                break;
+            }
+            *k = keys[j];
+        }
+        if (j == n) {
+            kt->seeds[b] = seed;
+            return 1;
+        }
+        while (j-- > 0) {
+            kt->slots[editorKeywordHash(keys[j].word, keys[j].len, seed) & mask].word = NULL;
+        }
+    }
+    return 0;
+}
+
+// Free the keyword table
+void editorKeywordsFree(struct keywordTable* kt) {
+    free(kt->seeds);
+    free(kt->slots);
+    kt->seeds = NULL;
+    kt->slots = NULL;
+    kt->nslots = 0;
+}
+
+// Compile the keywords of a syntax into the keyword table,
+// the secondary keywords end with '|'
+void editorKeywordsCompile(struct keywordTable* kt, char** keywords) {
+    editorKeywordsFree(kt);
+    int n = 0;
+    while (keywords && keywords[n]) {
+        n++;
+    }
+    if (n == 0) {
+        return;
+    }
+
+    // Buckets of 2 keywords on average in slots at most half filled
+    // let the seeds be found in a few tries
+    kt->nbuckets = 1;
+    while ((kt->nbuckets * 2) < n) {
+        kt->nbuckets *= 2;
+    }
+    kt->nslots = 2;
+    while (kt->nslots < (n * 2)) {
+        kt->nslots *= 2;
+    }
+    kt->maxlen = 0;
+
+    // Sort the keywords by their buckets
+    struct keywordSlot* keys = malloc(sizeof(struct keywordSlot) * n);
+    struct keywordSlot* sorted = malloc(sizeof(struct keywordSlot) * n);
+    int* bucket = malloc(sizeof(int) * n);
+    int* start = calloc((kt->nbuckets + 1), sizeof(int));
+    int* size = malloc(sizeof(int) * kt->nbuckets);
+    kt->seeds = calloc(kt->nbuckets, sizeof(unsigned int));
+    if ((keys == NULL) || (sorted == NULL) || (bucket == NULL) ||
+        (start == NULL) || (size == NULL) || (kt->seeds == NULL)) {
+        die("malloc");
+    }
+    for (int j = 0; j < n; j++) {
+        int len = strlen(keywords[j]);
+        int kw2 = (len > 0) && (keywords[j][len - 1] == '|');
+        keys[j].word = keywords[j];
+        keys[j].len = len - kw2;
+        keys[j].hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+        bucket[j] = editorKeywordHash(keys[j].word, keys[j].len, 0) & (kt->nbuckets - 1);
+        start[bucket[j] + 1]++;
+        if (keys[j].len > kt->maxlen) {
+            kt->maxlen = keys[j].len;
+        }
+    }
+    for (int b = 0; b < kt->nbuckets; b++) {
+        start[b + 1] += start[b];
+    }
+    for (int j = 0; j < n; j++) {
+        sorted[start[bucket[j]]++] = keys[j];
+    }
+
+    // Drop empty and duplicated keywords, which share the bucket
+    int maxsize = 0;
+    for (int b = 0; b < kt->nbuckets; b++) {
+        struct keywordSlot* members = &sorted[(b > 0) ? start[b - 1] : 0];
+        int count = start[b] - ((b > 0) ? start[b - 1] : 0);
+        size[b] = 0;
+        for (int j = 0; j < count; j++) {
+            int keep = (members[j].len > 0);
+            for (int i = 0; keep && (i < size[b]); i++) {
+                keep = (members[i].len != members[j].len) ||
+                    memcmp(members[i].word, members[j].word, members[j].len);
+            }
+            if (keep) {
+                members[size[b]++] = members[j];
+            }
+        }
+        if (size[b] > maxsize) {
+            maxsize = size[b];
+        }
+    }
+
+    // Larger buckets are placed first while most slots are free,
+    // the slots are doubled in the rare case a bucket can't be placed
+    int placed = 0;
+    while (!placed) {
+        kt->slots = calloc(kt->nslots, sizeof(struct keywordSlot));
+        if (kt->slots == NULL) {
+            die("calloc");
+        }
+        placed = 1;
+        for (int sz = maxsize; placed && (sz > 0); sz--) {
+            for (int b = 0; placed && (b < kt->nbuckets); b++) {
+                if (size[b] == sz) {
+                    placed = editorKeywordsPlace(kt, b,
+                        &sorted[(b > 0) ? start[b - 1] : 0], sz);
+                }
+            }
+        }
+        if (!placed) {
+            free(kt->slots);
+            kt->nslots *= 2;
+        }
+    }
+
+    free(keys);
+    free(sorted);
+    free(bucket);
+    free(start);
+    free(size);
+}
+
+// Find the keyword at the start of the text followed by a separator,
+// return its highlighting and length, or HL_NORMAL if it's not a keyword
+int editorKeywordFind(const struct keywordTable* kt, const char* s, int* len) {
+    if (kt->nslots == 0) {
+        return HL_NORMAL;
+    }
+    int n = 0;
+    while (!SEPARATORS[(unsigned char)s[n]]) {
+        if (n == kt->maxlen) {
+            return HL_NORMAL;
+        }
+        n++;
+    }
+    if (n == 0) {
+        return HL_NORMAL;
+    }
+
+    unsigned int b = editorKeywordHash(s, n, 0) & (kt->nbuckets - 1);
+    const struct keywordSlot* k =
+        &kt->slots[editorKeywordHash(s, n, kt->seeds[b]) & (kt->nslots - 1)];
+    if (k->word && (k->len == n) && !memcmp(k->word, s, n)) {
+        *len = n;
+        return k->hl;
+    }
+    return HL_NORMAL;
+}
+
+// Compile the character classes and the comment delimiters of the syntax
+void editorLexerCompile(struct lexTable* lt, const struct editorSyntax* syntax) {
+    for (int c = 0; c < 256; c++) {
+        lt->cls[c] = SEPARATORS[c] ? LEX_SEPARATOR : 0;
+    }
+    if (syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+        for (int c = '0'; c <= '9'; c++) {
+            lt->cls[c] |= LEX_DIGIT;
+        }
+        lt->cls['.'] |= LEX_DOT;
+    }
+    if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
+        lt->cls['"'] |= LEX_QUOTE;
+        lt->cls['\''] |= LEX_QUOTE;
+    }
+
+    // Multi-line comments are highlighted only with both delimiters
+    lt->scs = syntax->singleline_comment_start;
+    lt->mcs = syntax->multiline_comment_start;
+    lt->mce = syntax->multiline_comment_end;
+    lt->scs_len = lt->scs ? strlen(lt->scs) : 0;
+    lt->mcs_len = lt->mcs ? strlen(lt->mcs) : 0;
+    lt->mce_len = lt->mce ? strlen(lt->mce) : 0;
+    if ((lt->mcs_len == 0) || (lt->mce_len == 0)) {
+        lt->mcs_len = 0;
+        lt->mce_len = 0;
+    }
+    if (lt->scs_len) {
+        lt->cls[(unsigned char)lt->scs[0]] |= LEX_SCS;
+    }
+    if (lt->mcs_len) {
+        lt->cls[(unsigned char)lt->mcs[0]] |= LEX_MCS;
+        lt->cls[(unsigned char)lt->mce[0]] |= LEX_MCE;
+    }
+}
+
+// Check whether the text starts with the delimiter, a NUL ends the text
+int editorLexMatch(const char* s, const char* delim, const int len) {
+    int j = 0;
+    while ((j < len) && (s[j] == delim[j])) {
+        j++;
+    }
+    return j == len;
+}
+
+// Highlight the characters from i until the lexer passes stop with the state,
+// the text ends at end and characters after stop are only looked ahead;
+// return the position the lexer stopped at
+int editorLexSpan(const char* s, int i, const int stop, const int end,
+    unsigned char* hl, struct lexState* st) {
+    const struct lexTable* lt = &E.lexer;
+    const unsigned char* cls = lt->cls;
+
+    if (st->line_comment && (i < stop)) {
+        memset(&hl[i], HL_COMMENT, (stop - i));
+        return stop;
+    }
+
+    while (i < stop) {
+        // Multi-line comment: skip to a character that may end it
+        if (st->in_comment && lt->mce_len) {
+            int j = i;
+            while ((j < stop) && !(cls[(unsigned char)s[j]] & LEX_MCE)) {
+                j++;
+            }
+            memset(&hl[i], HL_MLCOMMENT, (j - i));
+            i = j;
+            if (i == stop) {
+                break;
+            }
+            if (editorLexMatch(&s[i], lt->mce, lt->mce_len)) {
+                memset(&hl[i], HL_MLCOMMENT, lt->mce_len);
+                i += lt->mce_len;
+                st->in_comment = 0;
+                st->prev_sep = 1;
+            } else {
+                hl[i++] = HL_MLCOMMENT;
+            }
+            continue;
+        }
+
+        // String: skip to the quote or an escape
+        if (st->in_string) {
+            int j = i;
+            while ((j < stop) && (s[j] != st->in_string) && (s[j] != '\\')) {
+                j++;
+            }
+            if (j > i) {
+                memset(&hl[i], HL_STRING, (j - i));
+                st->prev_sep = 1; // Set 1 to prepare the end of the string
+                i = j;
+                if (i == stop) {
+                    break;
+                }
+            }
+            hl[i] = HL_STRING;
+            if ((s[i] == '\\') && ((i + 1) < end)) {
+                // Continue highlighing when an escaped quote is detected
+                hl[i + 1] = HL_STRING;
+                i += 2;
+                continue;
+            }
+            if (s[i] == st->in_string) {
+                // Same quote is detected, therefore finish highlighting
+                st->in_string = 0;
+            }
+            i++;
+            st->prev_sep = 1;
+            continue;
+        }
+
+        // Rest of a word: nothing starts inside it
+        if (!st->prev_sep) {
+            while ((i < stop) && (cls[(unsigned char)s[i]] == 0)) {
+                i++;
+            }
+            if (i == stop) {
+                break;
+            }
+        }
+
+        char c = s[i];
+        unsigned char k = cls[(unsigned char)c];
+
+        // Single-line comment
+        if ((k & LEX_SCS) && editorLexMatch(&s[i], lt->scs, lt->scs_len)) {
+            memset(&hl[i], HL_COMMENT, (stop - i));
+            st->line_comment = 1;
+            i = stop;
+            break;
+        }
+
+        // Start of a multi-line comment
+        if ((k & LEX_MCS) && editorLexMatch(&s[i], lt->mcs, lt->mcs_len)) {
+            memset(&hl[i], HL_MLCOMMENT, lt->mcs_len);
+            i += lt->mcs_len;
+            st->in_comment = 1;
+            continue;
+        }
+
+        // Start of a string
+        if (k & LEX_QUOTE) {
+            st->in_string = c;
+            hl[i] = HL_STRING;
+            i++;
+            continue;
+        }
+
+        // Number
+        if (k & (LEX_DIGIT | LEX_DOT)) {
+            unsigned char prev_hl = (i > 0) ? hl[i - 1] : (st->number ? HL_NUMBER : HL_NORMAL);
+            if (((k & LEX_DIGIT) && (st->prev_sep || (prev_hl == HL_NUMBER))) ||
+                ((k & LEX_DOT) && (prev_hl == HL_NUMBER))) {
+                hl[i] = HL_NUMBER;
+                i++;
+                st->prev_sep = 0;
+                continue;
+            }
+        }
+
+        // Keywords
+        if (st->prev_sep) {
+            // Detect <separator>+<keyword>+<separator>
+            int klen;
+            int kw = editorKeywordFind(&E.keywords, &s[i], &klen);
+            if (kw != HL_NORMAL) {
+                memset(&hl[i], kw, klen);
+                i += klen;
+                st->prev_sep = 0;
+                continue;
+            }
+        }
+
+        st->prev_sep = (k & LEX_SEPARATOR) != 0;
+        i++;
+    }
+
+    if (i > 0) {
+        st->number = (hl[i - 1] == HL_NUMBER);
+    }
+    return i;
+}
+
+// Keep the first row of the stale regions for the checks of fresh rows
+void editorSyntaxStaleFirst(void) {
+    E.hl_stale = (E.hl_nstales > 0) ? E.hl_stales[0] : INT_MAX;
+}
+
+// Forget all stale regions
+void editorSyntaxStaleClear(void) {
+    E.hl_nstales = 0;
+    E.hl_stale = INT_MAX;
+}
+
+// Mark the row stale for its multi-line comment state, with the rows after it;
+// each region is kept until it settles, so one settling doesn't hide the others
+void editorSyntaxStale(const int at) {
+    int j = 0;
+    while ((j < E.hl_nstales) && (E.hl_stales[j] < at)) {
+        j++;
+    }
+    if ((j < E.hl_nstales) && (E.hl_stales[j] == at)) {
+        return;
+    }
+    if (E.hl_nstales == E.hl_stalecap) {
+        E.hl_stalecap = (E.hl_stalecap > 0) ? (E.hl_stalecap * 2) : 16;
+        E.hl_stales = realloc(E.hl_stales, (sizeof(int) * E.hl_stalecap));
+        if (E.hl_stales == NULL) {
+            die("realloc");
+        }
+    }
+    memmove(&E.hl_stales[j + 1], &E.hl_stales[j], (sizeof(int) * (E.hl_nstales - j)));
+    E.hl_stales[j] = at;
+    E.hl_nstales++;
+    editorSyntaxStaleFirst();
+}
+
+// Remove the stale regions starting before the row
+void editorSyntaxStaleUntil(const int at) {
+    int j = 0;
+    while ((j < E.hl_nstales) && (E.hl_stales[j] < at)) {
+        j++;
+    }
+    memmove(&E.hl_stales[0], &E.hl_stales[j], (sizeof(int) * (E.hl_nstales - j)));
+    E.hl_nstales -= j;
+    editorSyntaxStaleFirst();
+}
+
+// Shift the stale regions from the row by rows inserted or deleted there
+void editorSyntaxStaleShift(const int at, const int delta) {
+    int n = 0;
+    for (int j = 0; j < E.hl_nstales; j++) {
+        int r = E.hl_stales[j];
+        if (r >= at) {
+            r += delta;
+        }
+        // Regions moved onto the same row are merged
+        if ((n == 0) || (E.hl_stales[n - 1] != r)) {
+            E.hl_stales[n++] = r;
+        }
+    }
+    E.hl_nstales = n;
+    editorSyntaxStaleFirst();
+}
+
+// Check whether the highlighting of the row at the index is up to date,
+// a row waiting for the highlighter may end in another state
+int editorRowFresh(const erow* row, const int idx) {
+    return (row->hl_gen == E.hl_gen) && (idx < E.hl_stale) && !row->hl_pending;
+}
+
+// Drop the saved states after the row, which depend on it
+void editorSyntaxDropMarks(const int at) {
+    int keep = at / KILO_HL_MARK + 1;
+    if (E.hl_nmarks > keep) {
+        E.hl_nmarks = keep;
+    }
+}
+
+// Save the state before the next multiple of KILO_HL_MARK rows
+void editorSyntaxAddMark(const int in_comment) {
+    if (E.hl_nmarks == E.hl_markcap) {
+        E.hl_markcap = (E.hl_markcap > 0) ? (E.hl_markcap * 2) : 64;
+        E.hl_marks = realloc(E.hl_marks, E.hl_markcap);
+        if (E.hl_marks == NULL) {
+            die("realloc");
+        }
+    }
+    E.hl_marks[E.hl_nmarks++] = in_comment;
+}
+
+// Lex the characters of the row only for the multi-line comment state after it
+int editorRowScanState(erow* row, const int in_comment) {
+    char* mcs = E.syntax->multiline_comment_start;
+    char* mce = E.syntax->multiline_comment_end;
+    if ((mcs == NULL) || (mce == NULL) || (mcs[0] == '\0') || (mce[0] == '\0')) {
+        return 0;
+    }
+
+    unsigned char* hl;
+    char* text = editorLexScratch((row->size + 1), &hl);
+    int len = editorRowCopy(row, 0, row->size, text);
+    text[len] = '\0';
+
+    // Rows without the delimiter that changes the state keep it
+    const char* delim = in_comment ? mce : mcs;
+    int dlen = strlen(delim);
+    const char* end = text + len;
+    const char* p = text;
+    while ((p = memchr(p, delim[0], (end - p))) != NULL) {
+        if (((end - p) >= dlen) && !memcmp(p, delim, dlen)) {
+            break;
+        }
+        p++;
+    }
+    if (p == NULL) {
+        return in_comment;
+    }
+
+    struct lexState st = { 1, 0, in_comment, 0, 0 };
+    editorLexSpan(text, 0, len, len, hl, &st);
+    return st.in_comment;
+}
+
+// Get the multi-line comment state before the row, from the row before it
+// when it's fresh, or by scanning the rows from the nearest saved state
+int editorSyntaxStateBefore(const int idx) {
+    if (idx == 0) {
+        return 0;
+    }
+    erow* prev = editorRowAt(idx - 1);
+    if (editorRowFresh(prev, (idx - 1))) {
+        return prev->hl_open_comment;
+    }
+
+    // The scan starts before the stale mark too, so that the rows after it
+    // are settled together
+    int k = idx / KILO_HL_MARK;
+    if (k >= E.hl_nmarks) {
+        k = (E.hl_nmarks > 0) ? (E.hl_nmarks - 1) : 0;
+    }
+    if ((E.hl_stale / KILO_HL_MARK) < k) {
+        k = E.hl_stale / KILO_HL_MARK;
+    }
+    int in_comment = (k < E.hl_nmarks) ? E.hl_marks[k] : 0;
+    for (int r = k * KILO_HL_MARK; ; r++) {
+        if (((r % KILO_HL_MARK) == 0) && ((r / KILO_HL_MARK) == E.hl_nmarks)) {
+            editorSyntaxAddMark(in_comment);
+        }
+        if (r == idx) {
+            break;
+        }
+        erow* row = editorRowAt(r);
+        if (editorRowFresh(row, r)) {
+            in_comment = row->hl_open_comment;
+            continue;
+        }
+        // Rows without the render take the state, the others are
+        // highlighted again when they are used
+        in_comment = editorRowScanState(row, in_comment);
+        row->hl_open_comment = in_comment;
+        row->hl_gen = row->render ? 0 : E.hl_gen;
+    }
+
+    // The rows before the row are fresh or stale by their generation now
+    if (E.hl_stale < idx) {
+        editorSyntaxStaleUntil(idx);
+        editorSyntaxStale(idx);
+    }
+    return in_comment;
+}
+
+// Set the state after the row when it's highlighted
+void editorSyntaxSettle(erow* row, const int idx, const int in_comment) {
+    // The following rows are lexed with the state they had, new rows have none
+    int changed = (row->hl_gen != E.hl_gen) || (row->hl_open_comment != in_comment);
+    // The states saved after the row were taken with the state it ended in,
+    // which the scans keep for stale rows too
+    if (row->hl_open_comment != in_comment) {
+        editorSyntaxDropMarks(idx);
+    }
+    row->hl_open_comment = in_comment;
+    row->hl_gen = E.hl_gen;
+    row->hl_pending = 0;
+
+    // Instead of highlighting the following rows again now, the next row is
+    // marked stale and lexed when it's used, which moves the mark further
+    // until a row ends in the state it had before
+    if (idx == E.hl_stale) {
+        editorSyntaxStaleUntil(idx + 1);
+        if (changed) {
+            editorSyntaxStale(idx + 1);
+        }
+    } else if (changed) {
+        editorSyntaxStale(idx + 1);
+    }
+}
+
+// Put the highlighting of the characters to the render of the row,
+// the columns of a tab and the bytes of a character take its highlighting
+void editorRowMapSyntax(erow* row, const char* text, const unsigned char* hl) {
+    if (row->cmap) {
+        editorRenderChars(text, row->size, 0, row->rsize, row->render, hl, row->hl, row->cmap);
+        return;
+    }
+    int idx = 0;
+    for (int i = 0; i < row->size; i++) {
+        if (text[i] == '\t') {
+            int width = KILO_TAB_STOP - (idx % KILO_TAB_STOP);
+            memset(&row->hl[idx], hl[i], width);
+            idx += width;
+        } else {
+            row->hl[idx++] = hl[i];
+        }
+    }
+}
+
+// Update syntax values of the row
+void editorUpdateSyntax(erow* row) {
+    row->hl_ver = ++E.hl_ver;
+    if (!row->windowed) {
+        memset(row->hl, HL_NORMAL, editorRowRenderAt(row, row->rsize));
+    }
+
+    if (E.syntax == NULL) {
+        row->wlen = 0;
+        row->hl_gen = E.hl_gen;
+        row->hl_pending = 0;
+        return;
+    }
+
+    // 1 while parsing  comment
+    int idx = editorRowIdx(row);
+    int in_comment = editorSyntaxStateBefore(idx);
+
+    struct lexState st = { 1, 0, in_comment, 0, 0 };
+    if (row->windowed) {
+        // Long rows are lexed again from the saved state before the change
+        if (row->hl_gen != E.hl_gen) {
+            row->nlex = 0;
+            row->lexvalid = 0;
+        }
+        if (row->lexin != in_comment) {
+            row->lexvalid = 0;
+        }
+        row->lexin = in_comment;
+        row->wlen = 0;
+        editorRowLex(row, &st);
+    } else {
+        // The characters are lexed like the ones of long rows and rows scanned
+        // for their states, the render has lost the bytes of broken ones
+        unsigned char* hl;
+        char* text = editorLexScratch((row->size + 1), &hl);
+        editorRowCopy(row, 0, row->size, text);
+        text[row->size] = '\0';
+        memset(hl, HL_NORMAL, row->size);
+        editorLexSpan(text, 0, row->size, row->size, hl, &st);
+        editorRowMapSyntax(row, text, hl);
+    }
+    editorSyntaxSettle(row, idx, st.in_comment);
+}
+
+// Check whether the highlighter can lex the row: it's on the screen and
+// highlighted before, and the row before it is fresh or waits for it too
+int editorRowDefers(const erow* row, const int idx) {
+    if (!E.highlighter.active || (E.syntax == NULL) || !row->render || row->windowed ||
+        (row->hl_gen != E.hl_gen) || (idx < E.rowoff) || (idx >= (E.rowoff + E.screenrows))) {
+        return 0;
+    }
+    if (idx == 0) {
+        return 1;
+    }
+    erow* prev = editorRowAt(idx - 1);
+    return prev->hl_pending || editorRowFresh(prev, (idx - 1));
+}
+
+// Leave the row to the highlighter, the rows after it and the states saved
+// after it wait for the state it ends in
+void editorSyntaxDefer(erow* row, const int idx) {
+    row->hl_pending = 1;
+    editorSyntaxStale(idx + 1);
+    editorSyntaxDropMarks(idx);
+}
+
+// Update syntax values of the edited row, or let the highlighter do it while
+// the first kept bytes of the old highlighting are shown
+void editorQueueSyntax(erow* row, const int kept) {
+    int idx = editorRowIdx(row);
+    if (!editorRowDefers(row, idx)) {
+        editorUpdateSyntax(row);
+        return;
+    }
+
+    row->hl_ver = ++E.hl_ver;
+    int len = editorRowRenderAt(row, row->rsize);
+    if (kept < len) {
+        memset(&row->hl[kept], HL_NORMAL, (len - kept));
+    }
+    editorSyntaxDefer(row, idx);
+}
+
+// Return corresponding ANSI color code for each syntax value
+int editorSyntaxToColor(int hl) {
+    switch (hl) {
+        case HL_COMMENT:
+        case HL_MLCOMMENT: return 36; // Foreground cyan
+        case HL_KEYWORD1: return 33; // Foreground yellow
+        case HL_KEYWORD2: return 32; // Foreground green
+        case HL_STRING: return 35; // Foreground magenta
+        case HL_NUMBER: return 31; // Foreground red
+        case HL_MATCH: return 34; // Foreground blue
+        default: return 37; // Foreground white
+    }
+}
+
+// Get the highlighting info from the database
+void editorSelectSyntaxHighlight(void) {
+    // The highlighter lexes with the syntax, its results are dropped afterward
+    editorHighlighterWait();
+    E.syntax = NULL;
+    editorKeywordsFree(&E.keywords);
+    if (E.filename == NULL) {
+        return;
+    }
+
+    char* ext = strrchr(E.filename, '.');
+
+    // Search the extension from the database
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+        struct editorSyntax* s = &HLDB[j];
+        unsigned int i = 0;
+        while (s->filematch[i]) {
+            int is_ext = (s->filematch[i][0] == '.');
+            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+                (!is_ext && strstr(E.filename, s->filematch[i]))) {
+                E.syntax = s;
+                editorKeywordsCompile(&E.keywords, s->keywords);
+                editorLexerCompile(&E.lexer, s);
+
+                // Make the highlighting of all rows stale,
+                // they are highlighted again when they are used
+                E.hl_gen++;
+                editorSyntaxStaleClear();
+                E.hl_nmarks = 0;
+
+                return;
+            }
+            i++;
+        }
+    }
+}
+
+/*** text buffer ***/
+
+// Append characters to the append buffer and return the stored copy
+const char* editorAddText(const char* s, const int len) {
+    struct addBlock* blk = E.tb.add;
+    if ((blk == NULL) || ((blk->cap - blk->used) < len)) {
+        // Start a new block, the filled one stays in place for its pieces
+        int cap = (len > KILO_ADD_BLOCK_SIZE) ? len : KILO_ADD_BLOCK_SIZE;
+        blk = malloc(sizeof(struct addBlock) + cap);
+        if (blk == NULL) {
+            die("malloc");
+        }
+        blk->prev = E.tb.add;
+        blk->used = 0;
+        blk->cap = cap;
+        E.tb.add = blk;
+    }
+
+    char* text = &blk->data[blk->used];
+    memcpy(text, s, len);
+    blk->used += len;
+    return text;
+}
+
+// Extend the piece by a character if it ends at the tail of the append buffer
+int editorAddExtend(struct piece* p, const int c) {
+    struct addBlock* blk = E.tb.add;
+    if ((blk == NULL) || (blk->used == blk->cap) ||
+        ((p->text + p->len) != &blk->data[blk->used])) {
+        return 0;
+    }
+
+    blk->data[blk->used++] = c;
+    p->len++;
+    return 1;
+}
+
+// Release the original buffer and the append buffer
+void editorFreeTextBuffer(void) {
+    if (E.tb.orig_mapped) {
+        munmap(E.tb.orig, E.tb.orig_len);
+    } else {
+        free(E.tb.orig);
+    }
+    while (E.tb.add) {
+        struct addBlock* prev = E.tb.add->prev;
+        free(E.tb.add);
+        E.tb.add = prev;
+    }
+    E.tb.orig = NULL;
+    E.tb.orig_len = 0;
+    E.tb.orig_mapped = 0;
+}
+
+// Make the text holding the rows joined by newlines the original buffer,
+// each row becomes a single piece of it
+void editorRebaseRows(char* text, const size_t len, const int mapped) {
+    const char* p = text;
+    for (struct rowNode* leaf = editorRowFirstLeaf(); leaf; leaf = leaf->next) {
+        for (int i = 0; i < leaf->n; i++) {
+            erow* row = leaf->e.row[i];
+            if (row->size > 0) {
+                row->pieces[0].text = p;
+                row->pieces[0].len = row->size;
+                row->npieces = 1;
+            }
+            row->nmarks = 0;
+            p += row->size + 1;
+        }
+    }
+
+    editorFreeTextBuffer();
+    E.tb.orig = text;
+    E.tb.orig_len = len;
+    E.tb.orig_mapped = mapped;
+}
+
+/*** utf-8 ***/
+
+// Zero-width characters: combining marks, format characters and variation selectors
+const struct codeRange ZERO_WIDTH[] = {
+    { 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD }, { 0x05BF, 0x05BF },
+    { 0x05C1, 0x05C2 }, { 0x05C4, 0x05C5 }, { 0x05C7, 0x05C7 }, { 0x0610, 0x061A },
+    { 0x064B, 0x065F }, { 0x0670, 0x0670 }, { 0x06D6, 0x06DC }, { 0x06DF, 0x06E4 },
+    { 0x06E7, 0x06E8 }, { 0x06EA, 0x06ED }, { 0x0E31, 0x0E31 }, { 0x0E34, 0x0E3A },
+    { 0x0E47, 0x0E4E }, { 0x1AB0, 0x1AFF }, { 0x1DC0, 0x1DFF }, { 0x200B, 0x200F },
+    { 0x202A, 0x202E }, { 0x2060, 0x2064 }, { 0x20D0, 0x20FF }, { 0x302A, 0x302D },
+    { 0x3099, 0x309A }, { 0xFE00, 0xFE0F }, { 0xFE20, 0xFE2F }, { 0xFEFF, 0xFEFF },
+    { 0xE0100, 0xE01EF },
+};
+
+// East Asian wide and fullwidth characters
+const struct codeRange WIDE[] = {
+    { 0x1100, 0x115F }, { 0x231A, 0x231B }, { 0x2329, 0x232A }, { 0x23E9, 0x23EC },
+    { 0x25FD, 0x25FE }, { 0x2614, 0x2615 }, { 0x2E80, 0x3029 }, { 0x302E, 0x303E },
+    { 0x3041, 0x3098 }, { 0x309B, 0x33FF }, { 0x3400, 0x4DBF }, { 0x4E00, 0x9FFF },
+    { 0xA000, 0xA4CF }, { 0xA960, 0xA97F }, { 0xAC00, 0xD7A3 }, { 0xF900, 0xFAFF },
+    { 0xFE10, 0xFE19 }, { 0xFE30, 0xFE6F }, { 0xFF00, 0xFF60 }, { 0xFFE0, 0xFFE6 },
+    { 0x16FE0, 0x16FE4 }, { 0x17000, 0x18CFF }, { 0x1B000, 0x1B2FF },
+    { 0x1F300, 0x1F64F }, { 0x1F680, 0x1F6FF }, { 0x1F900, 0x1F9FF },
+    { 0x20000, 0x2FFFD }, { 0x30000, 0x3FFFD },
+};
+
+// Check if the code point is in the sorted ranges
+int editorInRanges(const int cp, const struct codeRange* r, const int n) {
+    int lo = 0;
+    int hi = n - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cp < r[mid].first) {
+            hi = mid - 1;
+        } else if (cp > r[mid].last) {
+            lo = mid + 1;
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Get the columns taken by the code point on the terminal
+int editorCharWidth(const int cp) {
+    if (editorInRanges(cp, ZERO_WIDTH, (sizeof(ZERO_WIDTH) / sizeof(ZERO_WIDTH[0])))) {
+        return 0;
+    }
+    if (editorInRanges(cp, WIDE, (sizeof(WIDE) / sizeof(WIDE[0])))) {
+        return 2;
+    }
+    return 1;
+}
+
+// Decode the UTF-8 character at the bytes and return its length, or 0 when
+// it's invalid (overlong, a surrogate, a C1 control or cut short)
+int editorUtf8Decode(const char* s, const int n, int* cp) {
+    const unsigned char* u = (const unsigned char*)s;
+    int len;
+    int min;
+    if ((u[0] >= 0xC2) && (u[0] <= 0xDF)) {
+        len = 2;
+        min = 0xA0;
+        *cp = u[0] & 0x1F;
+    } else if ((u[0] >= 0xE0) && (u[0] <= 0xEF)) {
+        len = 3;
+        min = 0x800;
+        *cp = u[0] & 0x0F;
+    } else if ((u[0] >= 0xF0) && (u[0] <= 0xF4)) {
+        len = 4;
+        min = 0x10000;
+        *cp = u[0] & 0x07;
+    } else {
+        return 0;
+    }
+    if (n < len) {
+        return 0;
+    }
+    for (int i = 1; i < len; i++) {
+        if ((u[i] & 0xC0) != 0x80) {
+            return 0;
+        }
+        *cp = (*cp << 6) | (u[i] & 0x3F);
+    }
+    if ((*cp < min) || (*cp > 0x10FFFF) || ((*cp >= 0xD800) && (*cp <= 0xDFFF))) {
+        return 0;
+    }
+    return len;
+}
+
+// Get the columns taken by the character starting with the non-ASCII byte:
+// continuation bytes take none, an invalid character is shown as '?'
+int editorUtf8Width(const char* s, const int n) {
+    if ((s[0] & 0xC0) == 0x80) {
+        return 0;
+    }
+    int cp;
+    return editorUtf8Decode(s, n, &cp) ? editorCharWidth(cp) : 1;
+}
+
+// Get the length of the leading run of ASCII characters other than tabs,
+// which take a column each, 16 bytes at a time
+int editorAsciiRun(const char* s, const int n) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i tab = _mm_set1_epi8('\t');
+    for (; (i + 16) <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&s[i]);
+        unsigned int stop = _mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, tab)));
+        if (stop) {
+            return i + __builtin_ctz(stop);
+        }
+    }
+#endif
+    while ((i < n) && (s[i] != '\t') && !(s[i] & 0x80)) {
+        i++;
+    }
+    return i;
+}
+
+// Check if the bytes are all ASCII, 16 bytes at a time
+int editorIsAscii(const char* s, const int n) {
+    int i = 0;
+#if defined(__SSE2__)
+    __m128i bits = _mm_setzero_si128();
+    for (; (i + 16) <= n; i += 16) {
+        bits = _mm_or_si128(bits, _mm_loadu_si128((const __m128i*)&s[i]));
+    }
+    if (_mm_movemask_epi8(bits)) {
+        return 0;
+    }
+#endif
+    for (; i < n; i++) {
+        if (s[i] & 0x80) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Render the characters from the column: tabs are expanded to spaces, invalid
+// UTF-8 characters are shown as '?' and lone continuation bytes are dropped.
+// The highlighting of the characters is carried along when it's given, and
+// the render offset of each column is put to the map (with the end of the
+// render after the last column); return the columns, stopping at the limit
+// after the zero-width characters following the last column
+int editorRenderChars(const char* text, const int len, const int rx, const int limit,
+    char* render, const unsigned char* hl, unsigned char* rhl, int* cmap) {
+    int col = 0;
+    int b = 0;
+    int n;
+    for (int i = 0; i < len; i += n) {
+        int start = b;
+        int cp;
+        n = 1;
+        if ((col >= limit) && (!(text[i] & 0x80) ||
+            ((n = editorUtf8Decode(&text[i], (len - i), &cp)) == 0) ||
+            (editorCharWidth(cp) != 0))) {
+            break;
+        }
+        // Zero-width characters join the bytes of the preceding column,
+        // the ones starting the row join the first column
+        int cell = ((col == 0) && (rx == 0)) ? 0 : b;
+        if (text[i] == '\t') {
+            int width = KILO_TAB_STOP - ((rx + col) % KILO_TAB_STOP);
+            for (int j = 0; j < width; j++) {
+                cmap[col++] = (j == 0) ? cell : b;
+                render[b++] = ' ';
+            }
+        } else if (!(text[i] & 0x80)) {
+            cmap[col++] = cell;
+            render[b++] = text[i];
+        } else if ((n = editorUtf8Decode(&text[i], (len - i), &cp)) > 0) {
+            for (int j = editorCharWidth(cp); j > 0; j--) {
+                cmap[col++] = cell;
+            }
+            memcpy(&render[b], &text[i], n);
+            b += n;
+        } else if ((text[i] & 0xC0) != 0x80) {
+            n = 1;
+            cmap[col++] = cell;
+            render[b++] = '?';
+        } else {
+            n = 1;
+        }
+        if (rhl) {
+            memset(&rhl[start], hl[i], (b - start));
+        }
+    }
+    cmap[col] = b;
+    return col;
+}
+
+/*** row operations ***/
+
+// Get the columns taken by the character at the non-ASCII byte of the piece,
+// the bytes following it may be in the next pieces
+int editorRowCharWidth(const erow* row, int k, int off) {
+    char buf[4];
+    int n = 0;
+    for (; (n < 4) && (k < row->npieces); k++, off = 0) {
+        for (; (n < 4) && (off < row->pieces[k].len); off++) {
+            buf[n++] = row->pieces[k].text[off];
+        }
+    }
+    return editorUtf8Width(buf, n);
+}
+
+// Advance the mapping over the characters from the position until it reaches cx
+// or the character ending beyond the rendering index rx (-1 not to stop by it),
+// and return the position reached
+int editorRowWalk(const erow* row, struct rowMark* mark, int pos, const int cx,
+    const int rx) {
+    while ((pos < cx) && (mark->k < row->npieces)) {
+        const struct piece* p = &row->pieces[mark->k];
+        if (mark->off >= p->len) {
+            mark->k++;
+            mark->off = 0;
+            continue;
+        }
+        // ASCII characters before the next tab take a column each
+        if (rx < 0) {
+            int n = (p->len - mark->off) < (cx - pos) ? (p->len - mark->off) : (cx - pos);
+            int run = editorAsciiRun(&p->text[mark->off], n);
+            if (run > 0) {
+                mark->rx += run;
+                mark->off += run;
+                pos += run;
+                continue;
+            }
+        }
+        int next = mark->rx + 1;
+        if (p->text[mark->off] == '\t') {
+            next += (KILO_TAB_STOP - 1) - (mark->rx % KILO_TAB_STOP);
+        } else if (p->text[mark->off] & 0x80) {
+            next = mark->rx + editorRowCharWidth(row, mark->k, mark->off);
+        }
+        if ((rx >= 0) && (next > rx)) {
+            break;
+        }
+        mark->rx = next;
+        mark->off++;
+        pos++;
+    }
+    return pos;
+}
+
+// Extend the checkpoints of the column mapping to cover the character position,
+// from the last one still valid
+void editorRowExtendMarks(erow* row, const int cx) {
+    int n = (((cx < row->size) ? cx : row->size) - 1) / KILO_ROW_MARK;
+    if (n <= row->nmarks) {
+        return;
+    }
+
+    if (n > row->markcap) {
+        size_t size = editorArenaCapacity(sizeof(struct rowMark) * n);
+        row->marks = editorArenaRealloc(&E.rowarena, row->marks,
+            (sizeof(struct rowMark) * row->markcap), size);
+        row->markcap = size / sizeof(struct rowMark);
+    }
+    struct rowMark mark = (row->nmarks > 0) ? row->marks[row->nmarks - 1] :
+        (struct rowMark){ 0, 0, 0 };
+    for (int m = row->nmarks + 1; m <= n; m++) {
+        editorRowWalk(row, &mark, ((m - 1) * KILO_ROW_MARK), (m * KILO_ROW_MARK), -1);
+        row->marks[m - 1] = mark;
+    }
+    row->nmarks = n;
+}
+
+// Drop the checkpoints of the column mapping at and after the edited position,
+// the pieces before it are kept by edits
+void editorRowTrimMarks(erow* row, const int at) {
+    int n = (at > 0) ? ((at - 1) / KILO_ROW_MARK) : 0;
+    if (row->nmarks > n) {
+        row->nmarks = n;
+    }
+}
+
+// Get the column mapping at the character position by walking
+// from the nearest checkpoint
+struct rowMark editorRowMarkAt(erow* row, const int cx) {
+    editorRowExtendMarks(row, cx);
+    int m = cx / KILO_ROW_MARK;
+    if (m > row->nmarks) {
+        m = row->nmarks;
+    }
+    struct rowMark mark = (m > 0) ? row->marks[m - 1] : (struct rowMark){ 0, 0, 0 };
+    editorRowWalk(row, &mark, (m * KILO_ROW_MARK), cx, -1);
+    return mark;
+}
+
+// Convert character position X to rendering position
+int editorRowCxToRx(erow* row, const int cx) {
+    return editorRowMarkAt(row, cx).rx;
+}
+
+// Convert rendering position X to character position
+int editorRowRxToCx(erow *row, const int rx) {
+    // Binary search for the last checkpoint not beyond the rendering index,
+    // they are extended only until one goes beyond it
+    while ((row->nmarks < ((row->size - 1) / KILO_ROW_MARK)) &&
+        ((row->nmarks == 0) || (row->marks[row->nmarks - 1].rx <= rx))) {
+        editorRowExtendMarks(row, ((row->nmarks + 8) * KILO_ROW_MARK));
+    }
+    int lo = 0;
+    int hi = row->nmarks;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (row->marks[mid - 1].rx <= rx) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    struct rowMark mark = (lo > 0) ? row->marks[lo - 1] : (struct rowMark){ 0, 0, 0 };
+    return editorRowWalk(row, &mark, (lo * KILO_ROW_MARK), row->size, rx);
+}
+
+// Get the position of the character before the one at the position,
+// with the zero-width characters following it
+int editorRowPrevChar(erow* row, const int cx) {
+    int rx = editorRowCxToRx(row, cx);
+    return (rx > 0) ? editorRowRxToCx(row, (rx - 1)) : 0;
+}
+
+// Get the position of the character after the one at the position,
+// skipping the zero-width characters following it
+int editorRowNextChar(erow* row, const int cx) {
+    if (cx >= row->size) {
+        return row->size;
+    }
+    return editorRowRxToCx(row, editorRowCxToRx(row, (cx + 1)));
+}
+
+// Find the first tab from the character position, -1 if there's no tab
+int editorRowFindTab(erow* row, const int from) {
+    int pos = 0;
+    for (int k = 0; k < row->npieces; k++) {
+        const struct piece* p = &row->pieces[k];
+        if ((pos + p->len) > from) {
+            int off = (from > pos) ? (from - pos) : 0;
+            const char* tab = memchr(&p->text[off], '\t', (p->len - off));
+            if (tab) {
+                return pos + (tab - p->text);
+            }
+        }
+        pos += p->len;
+    }
+    return -1;
+}
+
+// Reserve the render and the highlighting for the rendering size
+void editorRowReserveRender(erow* row, const int rsize) {
+    if ((rsize + 1) <= row->rcap) {
+        return;
+    }
+
+    // Grow geometrically so that typing reallocates only occasionally,
+    // the slot of the arena is used up before moving
+    int rcap = ((rsize + 1) > (row->rcap * 2)) ? (rsize + 1) : (row->rcap * 2);
+    rcap = editorArenaCapacity(rcap);
+    row->render = editorArenaRealloc(&E.rowarena, row->render, row->rcap, rcap);
+    row->hl = editorArenaRealloc(&E.rowarena, row->hl, row->rcap, rcap);
+    row->rcap = rcap;
+}
+
+// Reserve the column map of the render for the columns
+void editorRowReserveMap(erow* row, const int cols) {
+    if ((cols + 1) <= row->cmapcap) {
+        return;
+    }
+    size_t size = editorArenaCapacity(sizeof(int) * (cols + 1));
+    row->cmap = editorArenaRealloc(&E.rowarena, row->cmap,
+        (sizeof(int) * row->cmapcap), size);
+    row->cmapcap = size / sizeof(int);
+}
+
+// Drop the column map when the render becomes ASCII
+void editorRowDropMap(erow* row) {
+    editorArenaFree(&E.rowarena, row->cmap, (sizeof(int) * row->cmapcap));
+    row->cmap = NULL;
+    row->cmapcap = 0;
+}
+
+// Get the offset in the render of the column from the first one of the render
+int editorRowRenderAt(const erow* row, const int col) {
+    return row->cmap ? row->cmap[col] : col;
+}
+
+// Get the column from the first one of the render holding the offset
+int editorRowRenderCol(const erow* row, const int at) {
+    if (row->cmap == NULL) {
+        return at;
+    }
+    int len = row->windowed ? row->wlen : row->rsize;
+    int lo = 0;
+    int hi = len;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (row->cmap[mid] <= at) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    // The first column of a wide character
+    while ((lo > 0) && (row->cmap[lo - 1] == row->cmap[lo])) {
+        lo--;
+    }
+    return lo;
+}
+
+// Replace rendering cells in place by cells filled with the character
+void editorRowSpliceRender(erow* row, const int at, const int del, const int ins,
+    const int fill) {
+    editorRowReserveRender(row, (row->rsize - del + ins));
+    memmove(&row->render[at + ins], &row->render[at + del], (row->rsize - at - del + 1));
+    memmove(&row->hl[at + ins], &row->hl[at + del], (row->rsize - at - del));
+    memset(&row->render[at], fill, ins);
+    // Until the row is highlighted again, inserted cells look like the one before
+    memset(&row->hl[at], ((at > 0) ? row->hl[at - 1] : HL_NORMAL), ins);
+    row->rsize += ins - del;
+}
+
+// Expand the next tab again after the preceding cells are shifted,
+// the cells after the tab keep their alignment; return the change of its width
+int editorRowRealignTab(erow* row, const int from, const int rx_from,
+    const int shift) {
+    int t = editorRowFindTab(row, from);
+    if (t == -1) {
+        return 0;
+    }
+
+    int rx = rx_from + (t - from);
+    int old_width = KILO_TAB_STOP - ((rx - shift) % KILO_TAB_STOP);
+    int new_width = KILO_TAB_STOP - (rx % KILO_TAB_STOP);
+    if ((old_width != new_width) && !row->windowed) {
+        editorRowSpliceRender(row, rx, old_width, new_width, ' ');
+    }
+    return new_width - old_width;
+}
+
+// Copy the characters of the row from the position, return how many are copied
+int editorRowCopy(erow* row, const int cx, int len, char* buf) {
+    if (len > (row->size - cx)) {
+        len = row->size - cx;
+    }
+    struct rowMark mark = editorRowMarkAt(row, cx);
+    int n = 0;
+    for (int k = mark.k, off = mark.off; (n < len) && (k < row->npieces); k++, off = 0) {
+        int chunk = row->pieces[k].len - off;
+        if (chunk > (len - n)) {
+            chunk = len - n;
+        }
+        memcpy(&buf[n], &row->pieces[k].text[off], chunk);
+        n += chunk;
+    }
+    return n;
+}
+
+// Check if the characters in the range are ASCII, so that editing an ASCII
+// character among them changes the width of no other character
+int editorRowAsciiAround(erow* row, int from, int to) {
+    char buf[4];
+    from = (from > 0) ? from : 0;
+    to = (to < row->size) ? to : row->size;
+    if ((to - from) > (int)sizeof(buf)) {
+        to = from + sizeof(buf);
+    }
+    int n = (to > from) ? editorRowCopy(row, from, (to - from), buf) : 0;
+    for (int i = 0; i < n; i++) {
+        if (buf[i] & 0x80) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Get the scratch buffers of the lexer for the characters of a long row
+char* editorLexScratch(const int len, unsigned char** hl) {
+    static char* text = NULL;
+    static unsigned char* hls = NULL;
+    static int cap = 0;
+    if (len > cap) {
+        cap = len;
+        text = realloc(text, cap);
+        hls = realloc(hls, cap);
+        if ((text == NULL) || (hls == NULL)) {
+            die("realloc");
+        }
+    }
+    *hl = hls;
+    return text;
+}
+
+// Lex the characters of a long row from the position with the state until
+// the lexer passes the boundary, the characters and their highlighting are
+// left in the scratch buffers; return the position the lexer stopped at
+int editorRowLexChunk(erow* row, const int cx, const int at, struct lexState* st,
+    char** text, unsigned char** hl) {
+    int len = ((at + KILO_LEX_LOOKAHEAD) < row->size) ?
+        (at + KILO_LEX_LOOKAHEAD - cx) : (row->size - cx);
+    *text = editorLexScratch((len + 1), hl);
+    editorRowCopy(row, cx, len, *text);
+    (*text)[len] = '\0';
+    memset(*hl, HL_NORMAL, len);
+    if (E.syntax == NULL) {
+        return at;
+    }
+
+    int stop = ((at < row->size) ? at : row->size) - cx;
+    return cx + editorLexSpan(*text, 0, stop, (row->size - cx), *hl, st);
+}
+
+// Insert a lexer state to be saved at the boundary to the index
+void editorRowInsertLex(erow* row, const int j, const int at) {
+    if (row->nlex == row->lexcap) {
+        int n = (row->lexcap > 0) ? (row->lexcap * 2) : 8;
+        size_t size = editorArenaCapacity(sizeof(struct lexCheckpoint) * n);
+        row->lex = editorArenaRealloc(&E.rowarena, row->lex,
+            (sizeof(struct lexCheckpoint) * row->lexcap), size);
+        row->lexcap = size / sizeof(struct lexCheckpoint);
+    }
+    memmove(&row->lex[j + 1], &row->lex[j],
+        sizeof(struct lexCheckpoint) * (row->nlex - j));
+    row->lex[j].at = at;
+    row->lex[j].cx = -1;
+    row->nlex++;
+}
+
+// Lex a long row from the last valid saved state and save the states
+// at the chunk boundaries, it stops early where a state matches the one
+// saved before the edit; the state at the end is returned
+void editorRowLex(erow* row, struct lexState* st) {
+    int j = row->lexvalid;
+    int cx = 0;
+    if (j > 0) {
+        cx = row->lex[j - 1].cx;
+        *st = row->lex[j - 1].st;
+    }
+
+    char* text;
+    unsigned char* hl;
+    while (1) {
+        // Boundaries passed already are dropped, chunks grown by edits are split
+        while ((j < row->nlex) && (row->lex[j].at <= cx)) {
+            memmove(&row->lex[j], &row->lex[j + 1],
+                sizeof(struct lexCheckpoint) * (row->nlex - j - 1));
+            row->nlex--;
+        }
+        if ((j == row->nlex) || ((row->lex[j].at - cx) > (2 * KILO_LEX_CHUNK))) {
+            if ((cx + KILO_LEX_CHUNK) >= row->size) {
+                break;
+            }
+            editorRowInsertLex(row, j, (cx + KILO_LEX_CHUNK));
+        }
+        if (row->lex[j].at >= row->size) {
+            break;
+        }
+
+        struct lexState next = *st;
+        int ncx = editorRowLexChunk(row, cx, row->lex[j].at, &next, &text, &hl);
+        struct lexCheckpoint* cp = &row->lex[j];
+        if ((cp->cx > row->lexsame) && (cp->cx == ncx) &&
+            !memcmp(&cp->st, &next, sizeof(next))) {
+            // The rest is lexed the same as before the edit
+            row->lexvalid = row->nlex;
+            row->lexsame = -1;
+            st->in_comment = row->hl_open_comment;
+            return;
+        }
+        cp->cx = ncx;
+        cp->st = next;
+        *st = next;
+        cx = ncx;
+        j++;
+    }
+
+    // Lex the last chunk to the end of the row
+    row->nlex = j;
+    row->lexvalid = j;
+    row->lexsame = -1;
+    editorRowLexChunk(row, cx, row->size, st, &text, &hl);
+}
+
+// Shift the saved lexer states after the edited position of a long row,
+// the ones which have looked ahead over it are lexed again
+void editorRowShiftLex(erow* row, const int at, const int delta) {
+    for (int j = 0; j < row->nlex; j++) {
+        if (row->lex[j].at > at) {
+            row->lex[j].at += delta;
+        }
+        if (row->lex[j].cx > at) {
+            row->lex[j].cx += delta;
+        }
+    }
+    while ((row->lexvalid > 0) &&
+        ((row->lex[row->lexvalid - 1].cx + KILO_LEX_LOOKAHEAD) > at)) {
+        row->lexvalid--;
+    }
+    if (at > row->lexsame) {
+        row->lexsame = at;
+    }
+}
+
+// Render and highlight a window of the cells of a long row around the span,
+// the render of the other rows holds all the cells
+void editorRowWindow(erow* row, const int rx, const int len) {
+    if (!row->windowed || (len <= 0) || ((row->wlen > 0) && (rx >= row->wrx) &&
+        ((rx + len) <= (row->wrx + row->wlen)))) {
+        return;
+    }
+
+    int from = (rx > KILO_LONG_WINDOW) ? (rx - KILO_LONG_WINDOW) : 0;
+    int to = rx + len + KILO_LONG_WINDOW;
+    if (to > row->rsize) {
+        to = row->rsize;
+    }
+    if (from >= to) {
+        return;
+    }
+    int c0 = editorRowRxToCx(row, from);
+    int c1 = editorRowNextChar(row, editorRowRxToCx(row, (to - 1)));
+    struct rowMark mark = editorRowMarkAt(row, c0);
+
+    // Lex from the last saved state before the window
+    int lo = 0;
+    int hi = row->lexvalid;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (row->lex[mid - 1].cx <= c0) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    struct lexState st = { 1, 0, row->lexin, 0, 0 };
+    int base = 0;
+    if (lo > 0) {
+        base = row->lex[lo - 1].cx;
+        st = row->lex[lo - 1].st;
+    }
+    char* text;
+    unsigned char* hl;
+    editorRowLexChunk(row, base, c1, &st, &text, &hl);
+
+    // Expand tabs of the characters in the window, a window of non-ASCII
+    // text is rendered along with its column map
+    int cols = editorRowCxToRx(row, c1) - mark.rx;
+    int idx = 0;
+    if (editorIsAscii(&text[c0 - base], (c1 - c0))) {
+        editorRowDropMap(row);
+        editorRowReserveRender(row, cols);
+        for (int i = (c0 - base); i < (c1 - base); i++) {
+            if (text[i] == '\t') {
+                int width = KILO_TAB_STOP - ((mark.rx + idx) % KILO_TAB_STOP);
+                memset(&row->render[idx], ' ', width);
+                memset(&row->hl[idx], hl[i], width);
+                idx += width;
+            } else {
+                row->render[idx] = text[i];
+                row->hl[idx] = hl[i];
+                idx++;
+            }
+        }
+    } else {
+        editorRowReserveRender(row, (cols + (c1 - c0)));
+        editorRowReserveMap(row, cols);
+        idx = editorRenderChars(&text[c0 - base], (c1 - c0), mark.rx, cols, row->render,
+            &hl[c0 - base], row->hl, row->cmap);
+    }
+    row->render[editorRowRenderAt(row, idx)] = '\0';
+    row->wrx = mark.rx;
+    row->wlen = idx;
+}
+
+// Find the query in the rendering of the row, return the rendering index
+// of the first match or -1
+int editorRowFind(erow* row, const char* query) {
+    if (!row->windowed) {
+        char* match = strstr(row->render, query);
+        return match ? editorRowRenderCol(row, (match - row->render)) : -1;
+    }
+
+    // Long rows are searched window by window, overlapping by the query
+    int qlen = strlen(query);
+    for (int rx = 0; rx < row->rsize; rx += KILO_LONG_WINDOW) {
+        editorRowWindow(row, rx, (KILO_LONG_WINDOW + qlen));
+        char* match = strstr(&row->render[editorRowRenderAt(row, (rx - row->wrx))], query);
+        if (match) {
+            return row->wrx + editorRowRenderCol(row, (match - row->render));
+        }
+    }
+    return -1;
+}
+
+// Unlink the row from the render cache
+void editorRowCacheUnlink(erow* row) {
+    if (row->lru_prev) {
+        row->lru_prev->lru_next = row->lru_next;
+    } else {
+        E.cache.head = row->lru_next;
+    }
+    if (row->lru_next) {
+        row->lru_next->lru_prev = row->lru_prev;
+    } else {
+        E.cache.tail = row->lru_prev;
+    }
+    row->lru_prev = NULL;
+    row->lru_next = NULL;
+    E.cache.n--;
+}
+
+// Drop the render and the highlighting of the row,
+// the state of multi-line comments is kept
+void editorRowEvict(erow* row) {
+    editorRowCacheUnlink(row);
+    editorArenaFree(&E.rowarena, row->render, row->rcap);
+    editorArenaFree(&E.rowarena, row->hl, row->rcap);
+    editorRowDropMap(row);
+    row->render = NULL;
+    row->hl = NULL;
+    row->rsize = 0;
+    row->rcap = 0;
+    // A row left to the highlighter takes its state when it's used again
+    if (row->hl_pending) {
+        row->hl_pending = 0;
+        row->hl_gen = 0;
+    }
+    E.cache.evicted++;
+}
+
+// Make the row the most recently used one of the render cache,
+// the least recently used rows are evicted over the limit
+void editorRowCacheTouch(erow* row) {
+    if (E.cache.head == row) {
+        return;
+    }
+    if (row->render) {
+        editorRowCacheUnlink(row);
+    }
+
+    row->lru_next = E.cache.head;
+    if (E.cache.head) {
+        E.cache.head->lru_prev = row;
+    } else {
+        E.cache.tail = row;
+    }
+    E.cache.head = row;
+    E.cache.n++;
+
+    while (E.cache.n > KILO_RENDER_CACHE) {
+        editorRowEvict(E.cache.tail);
+    }
+}
+
+// Update the editor row
+void editorUpdateRow(erow* row) {
+    // The highlighting of the old render is kept while the highlighter lexes the new one
+    int kept = (row->render && !row->windowed) ? editorRowRenderAt(row, row->rsize) : -1;
+    editorRowCacheTouch(row);
+
+    // Long rows render only a window of the cells around the view
+    // and keep lexer states at chunk boundaries for highlighting it
+    row->windowed = (row->size > KILO_LONG_LINE);
+    row->wrx = 0;
+    row->wlen = 0;
+    if (row->windowed) {
+        row->nmarks = 0;
+        row->rsize = editorRowCxToRx(row, row->size);
+        editorRowSetLines(row, row->rsize);
+        row->nlex = 0;
+        row->lexvalid = 0;
+        row->lexsame = -1;
+        editorRowDropMap(row);
+        editorRowReserveRender(row, (3 * KILO_LONG_WINDOW));
+        editorUpdateSyntax(row);
+        return;
+    }
+
+    // Count tab and look for non-ASCII bytes
+    int tabs = 0;
+    int ascii = 1;
+    for (int k = 0; k < row->npieces; k++) {
+        const char* text = row->pieces[k].text;
+        for (int i = 0; i < row->pieces[k].len; i++) {
+            if (text[i] == '\t') {
+                tabs++;
+            }
+        }
+        ascii = ascii && editorIsAscii(text, row->pieces[k].len);
+    }
+
+    editorRowReserveRender(row, (row->size + tabs * (KILO_TAB_STOP - 1)));
+
+    // Checkpoints of the column mapping are taken along the characters
+    row->nmarks = 0;
+    editorRowExtendMarks(row, row->size);
+
+    // Non-ASCII text is rendered from a copy of the characters,
+    // which are decoded across the pieces
+    if (!ascii) {
+        int cols = editorRowCxToRx(row, row->size);
+        editorRowReserveMap(row, cols);
+        unsigned char* unused;
+        char* text = editorLexScratch(row->size, &unused);
+        editorRowCopy(row, 0, row->size, text);
+        row->rsize = editorRenderChars(text, row->size, 0, cols, row->render, NULL, NULL,
+            row->cmap);
+        row->render[row->cmap[row->rsize]] = '\0';
+        editorRowSetLines(row, row->rsize);
+        if (kept >= 0) {
+            editorQueueSyntax(row, kept);
+        } else {
+            editorUpdateSyntax(row);
+        }
+        return;
+    }
+
+    // Copy display characters to the render
+    editorRowDropMap(row);
+    int idx = 0;
+    for (int k = 0; k < row->npieces; k++) {
+        const char* text = row->pieces[k].text;
+        for (int i = 0; i < row->pieces[k].len; i++) {
+            // Expand tab
+            if (text[i] == '\t') {
+                row->render[idx++] = ' ';
+                while ((idx % KILO_TAB_STOP) != 0) {
+                    row->render[idx++] = ' ';
+                }
+            } else {
+                row->render[idx++] = text[i];
+            }
+        }
+    }
+    row->render[idx] = '\0';
+    row->rsize = idx;
+    editorRowSetLines(row, row->rsize);
+
+    if (kept >= 0) {
+        editorQueueSyntax(row, kept);
+    } else {
+        editorUpdateSyntax(row);
+    }
+}
+
+// Build the render and the highlighting of the row when it's viewed
+// or edited, stale preceding rows are left until they are used
+void editorRowMaterialize(erow* row) {
+    int idx = editorRowIdx(row);
+    if (row->render && editorRowFresh(row, idx)) {
+        editorRowCacheTouch(row);
+        return;
+    }
+    // Rows on the screen after the stale mark keep their highlighting
+    // until the highlighter lexes them again
+    if (editorRowDefers(row, idx)) {
+        editorSyntaxDefer(row, idx);
+        editorRowCacheTouch(row);
+        return;
+    }
+
+    // The state before the row comes from the nearest saved one
+    if (row->render) {
+        editorRowCacheTouch(row);
+        editorUpdateSyntax(row);
+    } else {
+        editorUpdateRow(row);
+    }
+}
+
+// Insert pieces to the piece list of the row at the index k
+void editorRowInsertPieces(erow* row, const int k, const struct piece* pieces,
+    const int n) {
+    if (n == 0) {
+        return;
+    }
+
+    if ((row->npieces + n) > row->piececap) {
+        size_t size = editorArenaCapacity(sizeof(struct piece) * (row->npieces + n));
+        row->pieces = editorArenaRealloc(&E.rowarena, row->pieces,
+            (sizeof(struct piece) * row->piececap), size);
+        row->piececap = size / sizeof(struct piece);
+    }
+    memmove(&row->pieces[k + n], &row->pieces[k],
+        sizeof(struct piece) * (row->npieces - k));
+    memcpy(&row->pieces[k], pieces, sizeof(struct piece) * n);
+    row->npieces += n;
+}
+
+// Make a piece boundary at the character position and return the index
+// of the piece starting from there
+int editorRowSplitPiece(erow* row, const int at) {
+    int pos = 0;
+    for (int k = 0; k < row->npieces; k++) {
+        if (at == pos) {
+            return k;
+        }
+        struct piece* p = &row->pieces[k];
+        if (at < (pos + p->len)) {
+            struct piece tail = { p->text + (at - pos), p->len - (at - pos) };
+            p->len = at - pos;
+            editorRowInsertPieces(row, (k + 1), &tail, 1);
+            return k + 1;
+        }
+        pos += p->len;
+    }
+    return row->npieces;
+}
+
+// Create a row of the pieces at the index, it's materialized on demand
+erow* editorNewRow(const int at, const struct piece* pieces, const int npieces) {
+    erow* row = editorArenaAlloc(&E.rowarena, sizeof(erow));
+    row->lines = 0;
+    editorRowTreeInsert(at, row);
+    E.numrows++;
+    editorSyntaxStaleShift(at, 1);
+    editorSyntaxDropMarks(at);
+
+    // Share the text of the pieces, they are never copied
+    row->size = 0;
+    for (int k = 0; k < npieces; k++) {
+        row->size += pieces[k].len;
+    }
+    row->npieces = 0;
+    row->piececap = 0;
+    row->pieces = NULL;
+    editorRowInsertPieces(row, 0, pieces, npieces);
+    row->marks = NULL;
+    row->nmarks = 0;
+    row->markcap = 0;
+
+    row->rsize = 0;
+    row->rcap = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->cmap = NULL;
+    row->cmapcap = 0;
+    row->windowed = 0;
+    row->wrx = 0;
+    row->wlen = 0;
+    row->lex = NULL;
+    row->nlex = 0;
+    row->lexcap = 0;
+    row->lexvalid = 0;
+    row->lexsame = -1;
+    row->lexin = 0;
+    row->hl_open_comment = 0;
+    row->hl_gen = 0;
+    row->hl_pending = 0;
+    row->hl_ver = 0;
+    row->lru_prev = NULL;
+    row->lru_next = NULL;
+    // The lines are counted from the size without expanding tabs until it's rendered
+    // or editorCountLinesToCursor() counts them from the columns
+    editorRowSetLines(row, row->size);
+    return row;
+}
+
+// Append characters to the editor row
+void editorInsertRow(const int at, const struct piece* pieces, const int npieces) {
+    if ((at < 0) || (at > E.numrows)) {
+        return;
+    }
+
+    // Update rendering row
+    editorUpdateRow(editorNewRow(at, pieces, npieces));
+
+    E.dirty++;
+}
+
+// Free the editor row
+void editorFreeRow(erow* row) {
+    if (row->render) {
+        editorRowEvict(row);
+    }
+    editorArenaFree(&E.rowarena, row->pieces, (sizeof(struct piece) * row->piececap));
+    editorArenaFree(&E.rowarena, row->marks, (sizeof(struct rowMark) * row->markcap));
+    editorArenaFree(&E.rowarena, row->lex, (sizeof(struct lexCheckpoint) * row->lexcap));
+    editorArenaFree(&E.rowarena, row, sizeof(erow));
+}
+
+// Delete the editor row
+void editorDelRow(const int at) {
+    if ((at < 0) || (at >= E.numrows)) {
+        return;
+    }
+
+    erow* row = editorRowTreeRemove(at);
+    E.numrows--;
+    editorSyntaxStaleShift((at + 1), -1);
+    editorSyntaxDropMarks(at);
+    // The next row takes the state before the row instead of its state,
+    // which is unknown when either of them is stale
+    erow* prev = (at > 0) ? editorRowAt(at - 1) : NULL;
+    if ((row->hl_gen != E.hl_gen) || (prev && (prev->hl_gen != E.hl_gen)) ||
+        (row->hl_open_comment != (prev ? prev->hl_open_comment : 0))) {
+        editorSyntaxStale(at);
+    }
+    editorFreeRow(row);
+    E.dirty++;
+}
+
+// Insert a character to the editor row
+void editorRowInsertChar(erow* row, int at, const int c) {
+    if ((at < 0) || (at > row->size)) {
+        at = row->size;
+    }
+    editorRowMaterialize(row);
+    // An ASCII character among ASCII ones changes no other widths
+    int plain = (c < 0x80) &&
+        (row->windowed ? editorRowAsciiAround(row, (at - 1), (at + 1)) : !row->cmap);
+
+    // Typing a run of characters keeps extending the same piece
+    int k = editorRowSplitPiece(row, at);
+    if ((k == 0) || !editorAddExtend(&row->pieces[k - 1], c)) {
+        char ch = c;
+        struct piece p = { editorAddText(&ch, 1), 1 };
+        editorRowInsertPieces(row, k, &p, 1);
+    }
+    row->size++;
+    editorRowTrimMarks(row, at);
+    if (!plain && !row->windowed) {
+        // UTF-8 characters around it may be joined or split, so they are rendered again
+        editorUpdateRow(row);
+        E.dirty++;
+        return;
+    }
+
+    // Patch the rendering cells of the character instead of rebuilding them,
+    // long rows render the window again after shifting the lexer states
+    int rx = editorRowCxToRx(row, at);
+    int width = (c == '\t') ? (KILO_TAB_STOP - (rx % KILO_TAB_STOP)) : 1;
+    if (row->windowed) {
+        if (plain) {
+            row->rsize += width + editorRowRealignTab(row, (at + 1), (rx + width), width);
+        } else {
+            row->rsize = editorRowCxToRx(row, row->size);
+        }
+        editorRowShiftLex(row, at, 1);
+        row->wlen = 0;
+    } else {
+        editorRowSpliceRender(row, rx, 0, width, ((c == '\t') ? ' ' : c));
+        editorRowRealignTab(row, (at + 1), (rx + width), width);
+    }
+    editorRowSetLines(row, row->rsize);
+    editorQueueSyntax(row, row->rsize);
+    E.dirty++;
+}
+
+// Append pieces to the editor row
+void editorRowAppendPieces(erow* row, const struct piece* pieces, const int n) {
+    editorRowInsertPieces(row, row->npieces, pieces, n);
+    for (int k = 0; k < n; k++) {
+        row->size += pieces[k].len;
+    }
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+// Delete a character from the editor row
+void editorRowDelChar(erow* row, const int at) {
+    if ((at < 0) || (at >= row->size)) {
+        return;
+    }
+
+    editorRowMaterialize(row);
+    int rx = editorRowCxToRx(row, at);
+    int width = editorRowCxToRx(row, (at + 1)) - rx;
+    int plain = row->windowed ? editorRowAsciiAround(row, (at - 1), (at + 2)) : !row->cmap;
+
+    // Find the piece holding the character
+    int k = 0;
+    int off = at;
+    while (off >= row->pieces[k].len) {
+        off -= row->pieces[k].len;
+        k++;
+    }
+
+    // Trim the piece, or split it when the character is in the middle
+    struct piece* p = &row->pieces[k];
+    if (off == 0) {
+        p->text++;
+        p->len--;
+    } else if (off == (p->len - 1)) {
+        p->len--;
+    } else {
+        struct piece tail = { p->text + off + 1, p->len - off - 1 };
+        p->len = off;
+        editorRowInsertPieces(row, (k + 1), &tail, 1);
+    }
+    if (row->pieces[k].len == 0) {
+        memmove(&row->pieces[k], &row->pieces[k + 1],
+            sizeof(struct piece) * (row->npieces - k - 1));
+        row->npieces--;
+    }
+    row->size--;
+    editorRowTrimMarks(row, at);
+    if (!plain && !row->windowed) {
+        editorUpdateRow(row);
+        E.dirty++;
+        return;
+    }
+
+    // Patch the rendering cells of the character instead of rebuilding them
+    if (row->windowed) {
+        if (plain) {
+            row->rsize += editorRowRealignTab(row, at, rx, -width) - width;
+        } else {
+            row->rsize = editorRowCxToRx(row, row->size);
+        }
+        editorRowShiftLex(row, at, -1);
+        row->wlen = 0;
+    } else {
+        editorRowSpliceRender(row, rx, width, 0, ' ');
+        editorRowRealignTab(row, at, rx, -width);
+    }
+    editorRowSetLines(row, row->rsize);
+    editorQueueSyntax(row, row->rsize);
+    E.dirty++;
+}
 
 /*** editor operations ***/
 
 // Insert a character
 void editorInsertChar(const int c) {
+    if ((E.cy == E.numrows) && !editorLoaderAllows(E.cy)) {
+        return;
+    }
     if (E.cy == E.numrows) {
-        editorInsertRow(E.numrows, "", 0);
+        editorInsertRow(E.numrows, NULL, 0);
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
+    editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
     E.cx++;
 }
 
 // Insert a newline
 void editorInsertNewline(void) {
+    if (!editorLoaderAllows((E.cx == 0) ? E.cy : (E.cy + 1))) {
+        return;
+    }
     if (E.cx == 0) {
-        editorInsertRow(E.cy, "", 0);
+        editorInsertRow(E.cy, NULL, 0);
     } else {
-        erow* row = &E.row[E.cy];
-        editorInsertRow((E.cy + 1), &row->chars[E.cx], (row->size - E.cx));
-        row = &E.row[E.cy];
+        // Move the pieces after the cursor to the new row
+        erow* row = editorRowAt(E.cy);
+        int k = editorRowSplitPiece(row, E.cx);
+        editorInsertRow((E.cy + 1), &row->pieces[k], (row->npieces - k));
+        row->npieces = k;
         row->size = E.cx;
-        row->chars[row->size] = '\0';
         editorUpdateRow(row);
     }
     E.cy++;
@@ -702,67 +3193,948 @@ void editorDelChar(void) {
         return;
     }
 
-    erow* row = &E.row[E.cy];
+    erow* row = editorRowAt(E.cy);
     if (E.cx > 0) {
-        editorRowDelChar(row, (E.cx - 1));
-        E.cx--;
+        // The bytes of the character go together with the zero-width ones after it
+        int from = editorRowPrevChar(row, E.cx);
+        while (E.cx > from) {
+            editorRowDelChar(row, (E.cx - 1));
+            E.cx--;
+        }
     } else {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+        erow* prev = editorRowAt(E.cy - 1);
+        E.cx = prev->size;
+        editorRowAppendPieces(prev, row->pieces, row->npieces);
         editorDelRow(E.cy);
         E.cy--;
     }
 }
 
-/*** file I/O ***/
+/*** line index ***/
 
-// Copy string of editor rows to the buffer
-char* editorRowsToString(int* buflen) {
-    // Get total length
-    int totlen = 0;
-    for (int j = 0; j < E.numrows; j++) {
-        totlen += E.row[j].size + 1;
-    }
-    *buflen = totlen;
-
-    // Copy editor rows to the buffer
-    char* buf = malloc(totlen);
-    char* p = buf;
-    for (int j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+// Reserve space for more line starts in the line index
+void editorLineIndexReserve(struct lineIndex* idx, const int more) {
+    if ((idx->n + more) > idx->cap) {
+        idx->cap = ((idx->n + more) > (idx->cap * 2)) ? (idx->n + more) : (idx->cap * 2);
+        idx->starts = realloc(idx->starts, sizeof(size_t) * idx->cap);
+        if (idx->starts == NULL) {
+            die("realloc");
+        }
+    }
+}
+
+// Add a line start to the line index
+void editorLineIndexPush(struct lineIndex* idx, const size_t start) {
+    editorLineIndexReserve(idx, 1);
+    idx->starts[idx->n++] = start;
+}
+
+// Add line starts after the newlines marked in the 64-bit mask of the block
+void editorLineIndexPushMask(struct lineIndex* idx, const char* buf,
+    const size_t from, unsigned long long nlmask, const unsigned long long crmask) {
+    // Count newlines preceded by '\r', also across the block boundary
+    unsigned long long carry = (from > 0) && (buf[from - 1] == '\r');
+    idx->crlf += __builtin_popcountll(nlmask & ((crmask << 1) | carry));
+
+    editorLineIndexReserve(idx, 64);
+    while (nlmask) {
+        idx->starts[idx->n++] = from + __builtin_ctzll(nlmask) + 1;
+        nlmask &= nlmask - 1;
+    }
+}
+
+// Index line starts after the newlines in buf[from, len), portable fallback
+void editorIndexLinesScalar(const char* buf, const size_t from, const size_t len,
+    struct lineIndex* idx) {
+    const char* p = &buf[from];
+    const char* end = &buf[len];
+    const char* nl;
+    while ((p < end) && ((nl = memchr(p, '\n', (end - p))) != NULL)) {
+        if ((nl > buf) && (nl[-1] == '\r')) {
+            idx->crlf++;
+        }
+        editorLineIndexPush(idx, (nl - buf + 1));
+        p = nl + 1;
+    }
+}
+
+// Index the lines from the position with memchr() while they are long,
+// and return where a short line starts for the blocks of the kernels
+size_t editorIndexLinesSparse(const char* buf, const size_t from, const size_t len,
+    struct lineIndex* idx) {
+    const char* p = &buf[from];
+    const char* end = &buf[len];
+    const char* nl;
+    while ((p < end) && ((nl = memchr(p, '\n', (end - p))) != NULL)) {
+        if ((nl > buf) && (nl[-1] == '\r')) {
+            idx->crlf++;
+        }
+        editorLineIndexPush(idx, (nl - buf + 1));
+        if ((nl - p) < 64) {
+            return nl - buf + 1;
+        }
+        p = nl + 1;
+    }
+    return len;
+}
+
+#if defined(__SSE2__)
+// Index line starts 64 bytes at a time with SSE2
+void editorIndexLinesSse2(const char* buf, size_t from, const size_t len,
+    struct lineIndex* idx) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    while ((from + 64) <= len) {
+        __m128i v[4];
+        unsigned long long nlmask = 0;
+        for (int i = 0; i < 4; i++) {
+            v[i] = _mm_loadu_si128((const __m128i*)&buf[from + (i * 16)]);
+            nlmask |= (unsigned long long)_mm_movemask_epi8(_mm_cmpeq_epi8(v[i], nl)) << (i * 16);
+        }
+        // Blocks without a newline are in long lines, which memchr() skips faster
+        if (nlmask == 0) {
+            from = editorIndexLinesSparse(buf, (from + 64), len, idx);
+            continue;
+        }
+        unsigned long long crmask = 0;
+        for (int i = 0; i < 4; i++) {
+            crmask |= (unsigned long long)_mm_movemask_epi8(_mm_cmpeq_epi8(v[i], cr)) << (i * 16);
+        }
+        editorLineIndexPushMask(idx, buf, from, nlmask, crmask);
+        from += 64;
+    }
+    editorIndexLinesScalar(buf, from, len, idx);
+}
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// Index line starts 64 bytes at a time with AVX2
+__attribute__((target("avx2")))
+void editorIndexLinesAvx2(const char* buf, size_t from, const size_t len,
+    struct lineIndex* idx) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    while ((from + 64) <= len) {
+        __m256i lo = _mm256_loadu_si256((const __m256i*)&buf[from]);
+        __m256i hi = _mm256_loadu_si256((const __m256i*)&buf[from + 32]);
+        __m256i nllo = _mm256_cmpeq_epi8(lo, nl);
+        __m256i nlhi = _mm256_cmpeq_epi8(hi, nl);
+        // Blocks without a newline are in long lines, which memchr() skips faster
+        __m256i any = _mm256_or_si256(nllo, nlhi);
+        if (_mm256_testz_si256(any, any)) {
+            from = editorIndexLinesSparse(buf, (from + 64), len, idx);
+            continue;
+        }
+        unsigned long long nlmask = (unsigned int)_mm256_movemask_epi8(nllo) |
+            ((unsigned long long)(unsigned int)_mm256_movemask_epi8(nlhi) << 32);
+        unsigned long long crmask =
+            (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, cr)) |
+            ((unsigned long long)(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, cr)) << 32);
+        editorLineIndexPushMask(idx, buf, from, nlmask, crmask);
+        from += 64;
+    }
+    editorIndexLinesScalar(buf, from, len, idx);
+}
+#endif
+
+// Table of newline indexers, the ones preferred for small files come first
+struct lineIndexer {
+    const char* name;
+    void (*index)(const char*, const size_t, const size_t, struct lineIndex*);
+    int (*supported)(void);
+};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// Check AVX2 is available on the running CPU
+int editorHasAvx2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+struct lineIndexer INDEXERS[] = {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    { "avx2", editorIndexLinesAvx2, editorHasAvx2 },
+#endif
+#if defined(__SSE2__)
+    { "sse2", editorIndexLinesSse2, NULL },
+#endif
+    { "scalar", editorIndexLinesScalar, NULL },
+};
+
+#define INDEXERS_ENTRIES (sizeof(INDEXERS) / sizeof(INDEXERS[0]))
+
+// Get the fastest newline indexer for the buffer, which depends on the lengths
+// of its lines as well as the CPU, by timing the supported ones on its start
+const struct lineIndexer* editorLineIndexer(const char* buf, const size_t len) {
+    struct lineIndex sample = { NULL, 0, 0, 0 };
+    const struct lineIndexer* best = NULL;
+    double best_time = 0;
+    for (unsigned int i = 0; i < INDEXERS_ENTRIES; i++) {
+        if (INDEXERS[i].supported && !INDEXERS[i].supported()) {
+            continue;
+        }
+        // Timing them would cost more than it saves for small buffers
+        if (len < (4 * KILO_INDEX_SAMPLE)) {
+            return &INDEXERS[i];
+        }
+        // The first run reads the pages of the sample
+        double time = 0;
+        for (int r = 0; r < 2; r++) {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            sample.n = 0;
+            sample.crlf = 0;
+            INDEXERS[i].index(buf, 0, KILO_INDEX_SAMPLE, &sample);
+            time = editorElapsed(&start);
+        }
+        if ((best == NULL) || (time < best_time)) {
+            best = &INDEXERS[i];
+            best_time = time;
+        }
+    }
+    free(sample.starts);
+    return best;
+}
+
+// Build the index of line starts of the buffer
+void editorIndexLines(const char* buf, const size_t len, struct lineIndex* idx) {
+    idx->n = 0;
+    idx->crlf = 0;
+    if (len == 0) {
+        return;
+    }
+
+    editorLineIndexPush(idx, 0);
+    editorLineIndexer(buf, len)->index(buf, 0, len, idx);
+    // Terminate the last line as if it ends with a newline
+    if (buf[len - 1] != '\n') {
+        editorLineIndexPush(idx, (len + 1));
+    }
+    idx->n--;
+}
+
+// Get the span of the line of the index, trailing '\r's are excluded
+struct piece editorLineIndexGet(const char* buf, const struct lineIndex* idx,
+    const int i) {
+    size_t start = idx->starts[i];
+    struct piece line = { &buf[start], (idx->starts[i + 1] - 1 - start) };
+    // Only the last line can end with '\r' when there are no CRLFs
+    if (idx->crlf || ((i + 1) == idx->n)) {
+        while ((line.len > 0) && (line.text[line.len - 1] == '\r')) {
+            line.len--;
+        }
+    }
+    return line;
+}
+
+/*** loader ***/
+
+// Wake up the main thread, a full pipe already has bytes to do it
+void editorLoaderNotify(struct loader* ld) {
+    if ((write(ld->notify[1], "", 1) == -1) && (errno != EAGAIN)) {
+        die("write");
+    }
+}
+
+// Index the lines of the contents chunk by chunk and hand them to the main thread
+void* editorLoaderRun(void* arg) {
+    struct loader* ld = arg;
+    const struct lineIndexer* indexer = editorLineIndexer(ld->buf, ld->len);
+    struct lineIndex chunk = { NULL, 0, 0, 0 };
+
+    for (size_t from = 0; from < ld->len; from += KILO_LOAD_CHUNK) {
+        size_t to = ((ld->len - from) > KILO_LOAD_CHUNK) ? (from + KILO_LOAD_CHUNK) : ld->len;
+        chunk.n = 0;
+        // Pages of the mapping are read here, not on the main thread
+        indexer->index(ld->buf, from, to, &chunk);
+
+        pthread_mutex_lock(&ld->lock);
+        int cancel = ld->cancel;
+        if (!cancel) {
+            editorLineIndexReserve(&ld->ready, chunk.n);
+            memcpy(&ld->ready.starts[ld->ready.n], chunk.starts, sizeof(size_t) * chunk.n);
+            ld->ready.n += chunk.n;
+        }
+        pthread_mutex_unlock(&ld->lock);
+        if (cancel) {
+            break;
+        }
+        editorLoaderNotify(ld);
+    }
+    free(chunk.starts);
+
+    pthread_mutex_lock(&ld->lock);
+    ld->finished = 1;
+    pthread_mutex_unlock(&ld->lock);
+    editorLoaderNotify(ld);
+    return NULL;
+}
+
+// Start loading the contents in the background
+void editorLoaderStart(const char* buf, const size_t len) {
+    struct loader* ld = &E.loader;
+    if (pipe(ld->notify) == -1) {
+        die("pipe");
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(ld->notify[i], F_SETFL, (fcntl(ld->notify[i], F_GETFL) | O_NONBLOCK));
+    }
+    pthread_mutex_init(&ld->lock, NULL);
+    ld->buf = buf;
+    ld->len = len;
+    ld->ready = (struct lineIndex){ NULL, 0, 0, 0 };
+    ld->finished = 0;
+    ld->cancel = 0;
+    ld->queue = (struct lineIndex){ NULL, 0, 0, 0 };
+    ld->next = 0;
+    ld->last = 0;
+    ld->start = 0;
+
+    if (pthread_create(&ld->thread, NULL, editorLoaderRun, ld) != 0) {
+        die("pthread_create");
+    }
+    ld->active = 1;
+}
+
+// Stop the loader, the rows not added yet are discarded
+void editorLoaderStop(void) {
+    struct loader* ld = &E.loader;
+    if (!ld->active) {
+        return;
+    }
+
+    pthread_mutex_lock(&ld->lock);
+    ld->cancel = 1;
+    pthread_mutex_unlock(&ld->lock);
+    pthread_join(ld->thread, NULL);
+
+    pthread_mutex_destroy(&ld->lock);
+    close(ld->notify[0]);
+    close(ld->notify[1]);
+    free(ld->ready.starts);
+    free(ld->queue.starts);
+    ld->active = 0;
+}
+
+// Append a row of the loaded line
+void editorLoaderAddRow(const size_t start, const size_t end) {
+    struct piece line = { &E.loader.buf[start], (end - start) };
+    while ((line.len > 0) && (line.text[line.len - 1] == '\r')) {
+        line.len--;
+    }
+    editorNewRow(E.numrows, &line, (line.len > 0));
+}
+
+// Add rows of the indexed lines for a time slice,
+// return 1 when there are lines left to be added
+int editorLoaderDrain(void) {
+    struct loader* ld = &E.loader;
+
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (int added = 1; ; added++) {
+        if (ld->next == ld->queue.n) {
+            if (ld->last) {
+                // The last line without a newline
+                if (ld->start < ld->len) {
+                    editorLoaderAddRow(ld->start, ld->len);
+                }
+                editorLoaderStop();
+                return 0;
+            }
+
+            // Take the lines indexed so far
+            pthread_mutex_lock(&ld->lock);
+            struct lineIndex taken = ld->ready;
+            ld->ready = ld->queue;
+            ld->ready.n = 0;
+            ld->queue = taken;
+            ld->last = ld->finished;
+            pthread_mutex_unlock(&ld->lock);
+            ld->next = 0;
+            if ((ld->queue.n == 0) && !ld->last) {
+                // Wait for the thread to index more
+                return 0;
+            }
+            continue;
+        }
+
+        size_t start = ld->queue.starts[ld->next++];
+        editorLoaderAddRow(ld->start, (start - 1));
+        ld->start = start;
+
+        if ((added % 4096) == 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long ms = (now.tv_sec - begin.tv_sec) * 1000 +
+                (now.tv_nsec - begin.tv_nsec) / 1000000;
+            if (ms >= KILO_LOAD_SLICE_MS) {
+                return 1;
+            }
+        }
+    }
+}
+
+
+// Check the loader has lines to be added without waiting for the thread
+int editorLoaderPending(void) {
+    return (E.loader.next < E.loader.queue.n) || E.loader.last;
+}
+
+// Add rows of the indexed lines, the pipe is emptied when it's notified
+void editorLoaderWake(const int notified) {
+    if (notified) {
+        char drain[64];
+        while (read(E.loader.notify[0], drain, sizeof(drain)) > 0) {
+        }
+    }
+    editorLoaderDrain();
+}
+
+// Wait for lines indexed by the loader and add rows of them
+void editorLoaderWait(void) {
+    struct pollfd fd = { E.loader.notify[0], POLLIN, 0 };
+    if ((poll(&fd, 1, (editorLoaderPending() ? 0 : -1)) == -1) && (errno != EINTR)) {
+        die("poll");
+    }
+    editorLoaderWake(fd.revents);
+}
+
+// Check lines can be added at the row index,
+// rows can't be added after the loaded ones while loading
+int editorLoaderAllows(const int at) {
+    if (E.loader.active && (at >= E.numrows)) {
+        editorSetStatusMessage("Still loading, lines can't be added at the end yet");
+        return 0;
+    }
+    return 1;
+}
+
+/*** saver ***/
+
+// Write all the iovecs to the file descriptor, resuming after partial writes
+int editorWriteAll(const int fd, struct iovec* iov, int n) {
+    while (n > 0) {
+        ssize_t written = writev(fd, iov, n);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while ((n > 0) && ((size_t)written >= iov->iov_len)) {
+            written -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+// Add the bytes to the iovecs, extending the last one when they follow it
+void editorIovecAdd(struct iovec* iov, int* n, const char* base, const size_t len) {
+    if ((*n > 0) && (((char*)iov[*n - 1].iov_base + iov[*n - 1].iov_len) == base)) {
+        iov[*n - 1].iov_len += len;
+    } else {
+        iov[*n].iov_base = (void*)base;
+        iov[*n].iov_len = len;
+        (*n)++;
+    }
+}
+
+// Take a snapshot of the rows as iovecs of their pieces and newlines,
+// the text of the pieces is never modified or moved by editing
+struct iovec* editorRowsToIovecs(int* n, size_t* len) {
+    static const char newline = '\n';
+    const char* orig_end = E.tb.orig + E.tb.orig_len;
+    int cap = KILO_SAVE_IOV;
+    struct iovec* iov = malloc(sizeof(struct iovec) * cap);
+    *n = 0;
+    *len = 0;
+
+    for (struct rowNode* leaf = editorRowFirstLeaf(); leaf; leaf = leaf->next) {
+        for (int i = 0; i < leaf->n; i++) {
+            erow* row = leaf->e.row[i];
+            for (int k = 0; k <= row->npieces; k++) {
+                if ((iov == NULL) || (*n == cap)) {
+                    cap *= 2;
+                    iov = realloc(iov, sizeof(struct iovec) * cap);
+                    if (iov == NULL) {
+                        die("realloc");
+                    }
+                }
+                if (k < row->npieces) {
+                    editorIovecAdd(iov, n, row->pieces[k].text, row->pieces[k].len);
+                    continue;
+                }
+                // Unchanged lines of the file are written with their own newlines,
+                // so that runs of them become a single iovec
+                const char* end = (*n > 0) ? ((char*)iov[*n - 1].iov_base + iov[*n - 1].iov_len) : NULL;
+                if ((end >= E.tb.orig) && (end < orig_end) && (*end == '\n')) {
+                    editorIovecAdd(iov, n, end, 1);
+                } else {
+                    editorIovecAdd(iov, n, &newline, 1);
+                }
+            }
+            *len += row->size + 1;
+        }
+    }
+    return iov;
+}
+
+// Flush the directory entry of the file to the disk
+int editorSyncDir(const char* filename) {
+    const char* slash = strrchr(filename, '/');
+    char* dir = slash ? strndup(filename, ((slash == filename) ? 1 : (slash - filename))) : strdup(".");
+    if (dir == NULL) {
+        return -1;
+    }
+    int fd = open(dir, O_RDONLY);
+    free(dir);
+    if (fd == -1) {
+        return -1;
+    }
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+// Get seconds elapsed from the time
+double editorElapsed(const struct timespec* since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+// Write the snapshot to a temporary file next to the target and rename it
+// over the target, the target is intact until the contents are complete
+void* editorSaverRun(void* arg) {
+    struct saver* sv = arg;
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    size_t pathlen = strlen(sv->filename);
+    char* tmp = malloc(pathlen + 8);
+    int fd = -1;
+    int ok = (tmp != NULL);
+    if (ok) {
+        snprintf(tmp, (pathlen + 8), "%s.XXXXXX", sv->filename);
+        fd = mkstemp(tmp);
+        ok = (fd != -1) && (fchmod(fd, sv->mode) != -1);
+    }
+    for (int i = 0; ok && (i < sv->niov); i += KILO_SAVE_IOV) {
+        int n = ((sv->niov - i) > KILO_SAVE_IOV) ? KILO_SAVE_IOV : (sv->niov - i);
+        ok = (editorWriteAll(fd, &sv->iov[i], n) != -1);
+    }
+    sv->write_sec = editorElapsed(&begin);
+
+    sv->fsync_sec = 0;
+#if KILO_ATOMIC_SAVE
+    if (ok) {
+        struct timespec sync;
+        clock_gettime(CLOCK_MONOTONIC, &sync);
+        ok = (fsync(fd) != -1);
+        sv->fsync_sec += editorElapsed(&sync);
+    }
+#endif
+    ok = ok && (rename(tmp, sv->filename) != -1);
+    sv->error = ok ? 0 : errno;
+    if (!ok && (fd != -1)) {
+        unlink(tmp);
+        close(fd);
+        fd = -1;
+    }
+
+    // The rename itself must reach the disk too, the file is saved
+    // even when it can't
+    sv->sync_error = 0;
+#if KILO_ATOMIC_SAVE
+    if (ok) {
+        struct timespec sync;
+        clock_gettime(CLOCK_MONOTONIC, &sync);
+        if (editorSyncDir(sv->filename) == -1) {
+            sv->sync_error = errno;
+        }
+        sv->fsync_sec += editorElapsed(&sync);
+    }
+#endif
+    sv->fd = fd;
+    free(tmp);
+
+    if (write(sv->notify[1], "", 1) == -1) {
+        die("write");
+    }
+    return NULL;
+}
+
+// Start saving a snapshot of the rows in the background
+void editorSaverStart(void) {
+    struct saver* sv = &E.saver;
+    if (pipe(sv->notify) == -1) {
+        die("pipe");
+    }
+    sv->filename = strdup(E.filename);
+    if (sv->filename == NULL) {
+        die("strdup");
+    }
+    struct stat st;
+    sv->mode = 0644; // The standard permissions for text file (read/write)
+    if (stat(E.filename, &st) == 0) {
+        sv->mode = st.st_mode & 07777;
+    }
+    sv->iov = editorRowsToIovecs(&sv->niov, &sv->len);
+    sv->dirty = E.dirty;
+
+    if (pthread_create(&sv->thread, NULL, editorSaverRun, sv) != 0) {
+        die("pthread_create");
+    }
+    sv->active = 1;
+}
+
+// Take the result of the saver
+void editorSaverFinish(void) {
+    struct saver* sv = &E.saver;
+    if (!sv->active) {
+        return;
+    }
+
+    pthread_join(sv->thread, NULL);
+    close(sv->notify[0]);
+    close(sv->notify[1]);
+    free(sv->iov);
+    free(sv->filename);
+    sv->active = 0;
+
+    if (sv->fd == -1) {
+        editorSetStatusMessage("Can't save! I/O error %s", strerror(sv->error));
+        return;
+    }
+
+    // Move the rows onto the saved file unless they are edited while saving,
+    // the old buffers are released
+    if (E.dirty == sv->dirty) {
+        if (sv->len > 0) {
+            char* map = mmap(NULL, sv->len, PROT_READ, MAP_PRIVATE, sv->fd, 0);
+            if (map != MAP_FAILED) {
+                editorRebaseRows(map, sv->len, 1);
+            }
+        }
+        E.dirty = 0;
+    }
+    close(sv->fd);
+
+    double mbps = (sv->write_sec > 0) ? (sv->len / sv->write_sec / 1e6) : 0.0;
+#if KILO_ATOMIC_SAVE
+    if (sv->sync_error) {
+        editorSetStatusMessage("%zu bytes written, but may not be on disk yet: %s",
+            sv->len, strerror(sv->sync_error));
+        return;
+    }
+    editorSetStatusMessage("%zu bytes written to disk (%.1f MB/s, fsync %.1f ms)",
+        sv->len, mbps, (sv->fsync_sec * 1000));
+#else
+    editorSetStatusMessage("%zu bytes written to disk (%.1f MB/s)", sv->len, mbps);
+#endif
+}
+
+/*** highlighter ***/
+
+// Lex the rows of the job with the state before them, the rows after the
+// waiting ones are lexed only while their states change
+void editorHighlighterLex(struct highlighter* hr) {
+    int last = 0;
+    for (int k = 0; k < hr->n; k++) {
+        if (hr->rows[k].pending) {
+            last = k;
+        }
+    }
+
+    int in_comment = hr->in_comment;
+    int start = 0;
+    hr->lexed = 0;
+    while (hr->lexed < hr->n) {
+        struct hlRow* r = &hr->rows[hr->lexed];
+        int len = r->end - start;
+        struct lexState st = { 1, 0, in_comment, 0, 0 };
+        memset(&hr->hl[start], HL_NORMAL, len);
+        editorLexSpan(&hr->text[start], 0, len, len, &hr->hl[start], &st);
+        in_comment = st.in_comment;
+        int same = (r->out == in_comment);
+        r->out = in_comment;
+        start = r->end + 1;
+        if ((hr->lexed++ >= last) && same) {
+            break;
+        }
+    }
+}
+
+// Lex the jobs given by the main thread
+void* editorHighlighterRun(void* arg) {
+    struct highlighter* hr = arg;
+    pthread_mutex_lock(&hr->lock);
+    while (1) {
+        while (!hr->busy) {
+            pthread_cond_wait(&hr->cond, &hr->lock);
+        }
+        pthread_mutex_unlock(&hr->lock);
+
+        editorHighlighterLex(hr);
+
+        pthread_mutex_lock(&hr->lock);
+        hr->busy = 0;
+        pthread_cond_broadcast(&hr->cond);
+        if (write(hr->notify[1], "", 1) == -1) {
+            die("write");
+        }
+    }
+    return NULL;
+}
+
+// Start the highlighter, it waits for jobs for the whole session
+void editorHighlighterStart(void) {
+    struct highlighter* hr = &E.highlighter;
+    if (pipe(hr->notify) == -1) {
+        die("pipe");
+    }
+    pthread_mutex_init(&hr->lock, NULL);
+    pthread_cond_init(&hr->cond, NULL);
+    hr->busy = 0;
+    hr->given = 0;
+    hr->rows = NULL;
+    hr->rowcap = 0;
+    hr->text = NULL;
+    hr->hl = NULL;
+    hr->cap = 0;
+    if (pthread_create(&hr->thread, NULL, editorHighlighterRun, hr) != 0) {
+        die("pthread_create");
+    }
+    hr->active = 1;
+}
+
+// Wait until the highlighter finishes lexing the job
+void editorHighlighterWait(void) {
+    struct highlighter* hr = &E.highlighter;
+    if (!hr->active) {
+        return;
+    }
+    pthread_mutex_lock(&hr->lock);
+    while (hr->busy) {
+        pthread_cond_wait(&hr->cond, &hr->lock);
+    }
+    pthread_mutex_unlock(&hr->lock);
+}
+
+// Append a row to the job of the highlighter
+void editorHighlighterAddRow(struct highlighter* hr, erow* row, size_t* len) {
+    int rlen = row->size;
+    if ((*len + rlen + 1) > hr->cap) {
+        hr->cap = ((*len + rlen + 1) > (hr->cap * 2)) ? (*len + rlen + 1) : (hr->cap * 2);
+        hr->text = realloc(hr->text, hr->cap);
+        hr->hl = realloc(hr->hl, hr->cap);
+        if ((hr->text == NULL) || (hr->hl == NULL)) {
+            die("realloc");
+        }
+    }
+    if (hr->n == hr->rowcap) {
+        hr->rowcap = hr->rowcap ? (hr->rowcap * 2) : 64;
+        hr->rows = realloc(hr->rows, sizeof(struct hlRow) * hr->rowcap);
+        if (hr->rows == NULL) {
+            die("realloc");
+        }
+    }
+
+    editorRowCopy(row, 0, rlen, &hr->text[*len]);
+    *len += rlen;
+    hr->text[(*len)++] = '\0';
+    hr->rows[hr->n++] = (struct hlRow){ (*len - 1), row->hl_ver, row->hl_open_comment,
+        row->hl_pending };
+}
+
+// Give the highlighter a snapshot of the rows from the first one waiting on
+// or right above the screen through the end of the screen, unless it has
+// a job already
+void editorHighlighterSubmit(void) {
+    struct highlighter* hr = &E.highlighter;
+    if (!hr->active || hr->given || (E.syntax == NULL)) {
+        return;
+    }
+
+    // Rows edited before the screen scrolled away wait above it
+    int end = ((E.rowoff + E.screenrows) < E.numrows) ? (E.rowoff + E.screenrows) : E.numrows;
+    int first = (E.rowoff < end) ? E.rowoff : end;
+    while (first > 0) {
+        erow* prev = editorRowAt(first - 1);
+        if (!prev->hl_pending || !prev->render || prev->windowed) {
+            break;
+        }
+        first--;
+    }
+    if (first == E.rowoff) {
+        while ((first < end) && !editorRowAt(first)->hl_pending) {
+            first++;
+        }
+    }
+    if (first == end) {
+        return;
+    }
+
+    // Long rows are lexed on the main thread, the job ends before them
+    hr->n = 0;
+    size_t len = 0;
+    for (int idx = first; idx < end; idx++) {
+        erow* row = editorRowAt(idx);
+        if (!row->render || row->windowed) {
+            break;
+        }
+        editorHighlighterAddRow(hr, row, &len);
+    }
+    if (hr->n == 0) {
+        return;
+    }
+    hr->gen = E.hl_gen;
+    hr->first = first;
+    // The row before may be stale too when the screen moved away from it
+    hr->in_comment = editorSyntaxStateBefore(first);
+
+    pthread_mutex_lock(&hr->lock);
+    hr->busy = 1;
+    pthread_cond_signal(&hr->cond);
+    pthread_mutex_unlock(&hr->lock);
+    hr->given = 1;
+    hr->jobs++;
+}
+
+// Take the results of the highlighter, rows changed since the snapshot
+// and the rows after them are left waiting for the next job
+void editorHighlighterFinish(void) {
+    struct highlighter* hr = &E.highlighter;
+    char c;
+    if (read(hr->notify[0], &c, 1) == -1) {
+        die("read");
+    }
+    editorHighlighterWait();
+    hr->given = 0;
+    if (hr->gen != E.hl_gen) {
+        hr->dropped += hr->lexed;
+        return;
+    }
+
+    int in_comment = hr->in_comment;
+    int start = 0;
+    for (int k = 0; k < hr->lexed; k++) {
+        const struct hlRow* r = &hr->rows[k];
+        int idx = hr->first + k;
+        erow* row = (idx < E.numrows) ? editorRowAt(idx) : NULL;
+        if ((row == NULL) || !row->render || (row->hl_ver != r->ver) ||
+            (((k == 0) ? editorSyntaxStateBefore(idx) :
+            editorRowAt(idx - 1)->hl_open_comment) != in_comment)) {
+            hr->dropped += hr->lexed - k;
+            return;
+        }
+        editorRowMapSyntax(row, &hr->text[start], &hr->hl[start]);
+        row->hl_ver = ++E.hl_ver;
+        editorSyntaxSettle(row, idx, r->out);
+        hr->applied++;
+        in_comment = r->out;
+        start = r->end + 1;
     }
+}
+
+/*** file I/O ***/
 
-    return buf;
+// Close the buffer, the rows are released with their arena at once
+void editorCloseBuffer(void) {
+    editorLoaderStop();
+    editorSaverFinish();
+    editorArenaRelease(&E.rowarena);
+    editorFreeTextBuffer();
+    E.cache.head = NULL;
+    E.cache.tail = NULL;
+    E.cache.n = 0;
+    E.rowtree = editorRowNodeNew(1);
+    E.numrows = 0;
+    editorSyntaxStaleClear();
+    E.hl_nmarks = 0;
+    E.cx = 0;
+    E.cy = 0;
+    E.rx = 0;
+    E.rowoff = 0;
+    E.coloff = 0;
+    E.lineoff = 0;
+    E.dirty = 0;
 }
 
 // Open the file
 void editorOpen(const char* filename) {
+    editorCloseBuffer();
+
     free(E.filename);
     E.filename = strdup(filename);
 
     editorSelectSyntaxHighlight();
 
-    FILE* fp = fopen(filename, "r");
-    if (!fp) {
-        die("fopen");
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        die("open");
     }
 
-    char* line = NULL;
-    size_t linecap = 0; // Capacity of line
-    ssize_t linelen; // Length of reading line
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        while ((linelen > 0) &&
-               ((line[linelen - 1] == '\n') || (line[linelen - 1] == '\r'))) {
-            linelen--;
+    // Map the file as the original buffer of the piece table,
+    // pages are read only when rows on them are used
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        die("fstat");
+    }
+    E.tb.orig_len = st.st_size;
+    if (S_ISREG(st.st_mode) && (E.tb.orig_len > 0)) {
+        E.tb.orig = mmap(NULL, E.tb.orig_len, PROT_READ, MAP_PRIVATE, fd, 0);
+        E.tb.orig_mapped = (E.tb.orig != MAP_FAILED);
+    }
+    if (!E.tb.orig_mapped) {
+        // Read the whole contents when the file can't be mapped
+        size_t cap = E.tb.orig_len + 1;
+        E.tb.orig = malloc(cap);
+        E.tb.orig_len = 0;
+        ssize_t n;
+        while (E.tb.orig &&
+               ((n = read(fd, &E.tb.orig[E.tb.orig_len], (cap - E.tb.orig_len))) != 0)) {
+            if (n == -1) {
+                die("read");
+            }
+            E.tb.orig_len += n;
+            if (E.tb.orig_len == cap) {
+                cap *= 2;
+                E.tb.orig = realloc(E.tb.orig, cap);
+            }
         }
-        editorInsertRow(E.numrows, line, linelen);
+        if (E.tb.orig == NULL) {
+            die("malloc");
+        }
+    }
+    close(fd);
+
+    // Each row starts as a single piece of the original buffer
+    if (E.tb.orig_mapped && (E.tb.orig_len > KILO_LOAD_ASYNC)) {
+        // Large files are loaded in the background,
+        // only the rows of the first screen are waited for
+        editorLoaderStart(E.tb.orig, E.tb.orig_len);
+        while (E.loader.active && (E.numrows <= E.screenrows)) {
+            editorLoaderWait();
+        }
+        E.dirty = 0;
+        return;
     }
-
-    free(line);
-    fclose(fp);
+    struct lineIndex idx = { NULL, 0, 0, 0 };
+    editorIndexLines(E.tb.orig, E.tb.orig_len, &idx);
+    for (int i = 0; i < idx.n; i++) {
+        struct piece line = editorLineIndexGet(E.tb.orig, &idx, i);
+        editorNewRow(E.numrows, &line, (line.len > 0));
+    }
+    free(idx.starts);
 
     E.dirty = 0;
 }
@@ -777,29 +4149,20 @@ void editorSave(void) {
         }
         editorSelectSyntaxHighlight();
     }
+    if (E.loader.active) {
+        editorSetStatusMessage("Still loading, can't save yet");
+        return;
+    }
 
-    int len;
-    char* buf = editorRowsToString(&len);
-
-    // Open a file descriptor
-    // `0644` is the standrd permissions for text file (read/write)
-    int fd = open(E.filename, (O_RDWR | O_CREAT), 0644);
-    if (fd != -1) {
-        // Truncate the file size
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
-        }
-        close(fd);
+    if (E.saver.active) {
+        editorSetStatusMessage("Still saving the previous contents");
+        return;
     }
 
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error %s", strerror(errno));
+    // Rows may refer to the mapping of the file, so it isn't overwritten
+    // in place but replaced by a new file written in the background
+    editorSaverStart();
+    editorSetStatusMessage("Saving...");
 }
 
 /*** find ***/
@@ -810,9 +4173,20 @@ void editorFindCallback(char* query, int key) {
 
     static int saved_hl_line; // Line which highlighting is saved
     static char* saved_hl = NULL; // Saved highlighting
+    static int saved_hl_rx; // Rendering index and length of the saved cells
+    static int saved_hl_len;
+    static unsigned int saved_hl_ver; // Version of the highlighting with the match
 
     if (saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
+        erow* row = editorRowAt(saved_hl_line);
+        editorRowMaterialize(row);
+        // The window of a long row may have been rendered again
+        int len = editorRowRenderAt(row, (row->windowed ? row->wlen : row->rsize));
+        // A row highlighted again since then has nothing to restore
+        if ((row->hl_ver == saved_hl_ver) && (row->wrx == saved_hl_rx) &&
+            (len == saved_hl_len)) {
+            memcpy(row->hl, saved_hl, len);
+        }
         free(saved_hl); // saved_hl is guaranteed to be deallocated here
         saved_hl = NULL;
     }
@@ -848,18 +4222,30 @@ void editorFindCallback(char* query, int key) {
             current = 0;
         }
 
-        erow *row  = &E.row[current];
-        char *match = strstr(row->render, query);
-        if (match) {
+        erow *row  = editorRowAt(current);
+        editorRowMaterialize(row);
+        int match = editorRowFind(row, query);
+        if (match != -1) {
             last_match = current;
             E.cy = current;
-            E.cx = editorRowRxToCx(row, (match - row->render));
+            E.cx = editorRowRxToCx(row, match);
             E.rowoff = E.numrows;
+            E.lineoff = E.rowtree->lines;
 
+            // The match is marked on the highlighting of the current text,
+            // and the highlighter doesn't overwrite it with a result lexed before
+            if (row->hl_pending) {
+                editorUpdateSyntax(row);
+            }
+            row->hl_ver = ++E.hl_ver;
+            saved_hl_ver = row->hl_ver;
             saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
+            saved_hl_rx = row->wrx;
+            saved_hl_len = editorRowRenderAt(row, (row->windowed ? row->wlen : row->rsize));
+            saved_hl = malloc(saved_hl_len);
+            memcpy(saved_hl, row->hl, saved_hl_len);
+            memset(&row->hl[editorRowRenderAt(row, (match - row->wrx))], HL_MATCH,
+                strlen(query));
             break;
         }
     }
@@ -871,6 +4257,7 @@ void editorFind(void) {
     int saved_cy = E.cy;
     int saved_coloff = E.coloff;
     int saved_rowoff = E.rowoff;
+    int saved_lineoff = E.lineoff;
 
     // Search the input string by any key-press event
     char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
@@ -882,6 +4269,7 @@ void editorFind(void) {
         E.cy = saved_cy;
         E.coloff = saved_coloff;
         E.rowoff = saved_rowoff;
+        E.lineoff = saved_lineoff;
     }
 }
 
@@ -891,21 +4279,37 @@ void editorFind(void) {
 struct abuf {
     char* b; // Character buffer
     int len; // Length
+    int cap; // Capacity
+    size_t grows; // The number of reallocations
 };
 
 // Initial buffer
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0, 0}
+
+// Reserve space for additional characters, return where they are written
+// (the caller adds their length) or NULL on failure
+char* abReserve(struct abuf* ab, int len) {
+    // Reallocate the append buffer geometrically by additional characters
+    if ((ab->len + len) > ab->cap) {
+        int cap = ((ab->len + len) > (ab->cap * 2)) ? (ab->len + len) : (ab->cap * 2);
+        char* new = realloc(ab->b, cap);
+        if (new == NULL) {
+            return NULL;
+        }
+        ab->b = new;
+        ab->cap = cap;
+        ab->grows++;
+    }
+    return &ab->b[ab->len];
+}
 
 // Append new characters to the append buffer
 void abAppend(struct abuf* ab, const char* s, int len) {
-    // Reallocate and update the append buffer by additional characters
-    char* new = realloc(ab->b, ab->len + len);
-    if (new == NULL) {
+    char* p = abReserve(ab, len);
+    if (p == NULL) {
         return;
     }
-
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
+    memcpy(p, s, len);
     ab->len += len;
 }
 
@@ -914,14 +4318,467 @@ void abFree(struct abuf* ab) {
     free(ab->b);
 }
 
+/*** screen ***/
+
+// Allocate the cells of the grid
+void editorScreenGridInit(struct screenGrid* grid, const int rows, const int cols) {
+    grid->chars = malloc(rows * cols);
+    grid->attrs = malloc(rows * cols);
+    grid->multibyte = calloc(rows, 1);
+    if ((grid->chars == NULL) || (grid->attrs == NULL) || (grid->multibyte == NULL)) {
+        die("malloc");
+    }
+}
+
+// Allocate the screen model for the window size
+void editorScreenInit(void) {
+    E.screen.rows = E.screenrows + 2;
+    E.screen.cols = E.screencols;
+    E.screen.stride = E.screen.cols * KILO_CELL_BYTES;
+    editorScreenGridInit(&E.screen.front, E.screen.rows, E.screen.stride);
+    editorScreenGridInit(&E.screen.back, E.screen.rows, E.screen.stride);
+    E.screen.valid = 0;
+    // The characters of a row drawn as plain text are followed by their cells
+    E.screen.plain = malloc(3 * E.screen.stride + 3 * KILO_TAB_STOP);
+    E.screen.plainmap = malloc(sizeof(int) * (E.screen.cols + 2 * KILO_TAB_STOP + 1));
+    if ((E.screen.plain == NULL) || (E.screen.plainmap == NULL)) {
+        die("malloc");
+    }
+
+    // Build the escape sequences of the attributes beforehand
+    for (int attr = 0; attr < 256; attr++) {
+        char* seq = E.screen.sgr[attr].seq;
+        int hl = attr & ~ATTR_INVERSE;
+        int fg = ((hl == HL_NORMAL) || (hl > HL_MATCH)) ? 39 : editorSyntaxToColor(hl);
+        if (fg == 39) {
+            E.screen.sgr[attr].len = snprintf(seq, sizeof(E.screen.sgr[attr].seq),
+                ((attr & ATTR_INVERSE) ? "\x1b[0;7m" : "\x1b[m"));
+        } else {
+            E.screen.sgr[attr].len = snprintf(seq, sizeof(E.screen.sgr[attr].seq),
+                ((attr & ATTR_INVERSE) ? "\x1b[0;7;%dm" : "\x1b[0;%dm"), fg);
+        }
+        // Attributes looking the same (e.g. comments) don't need a new sequence
+        E.screen.style[attr] = attr;
+        for (int prev = 0; prev < attr; prev++) {
+            if (!strcmp(E.screen.sgr[prev].seq, seq)) {
+                E.screen.style[attr] = prev;
+                break;
+            }
+        }
+    }
+}
+
+// Clear the row of the frame being drawn
+void editorScreenClearRow(const int y) {
+    memset(&E.screen.back.chars[y * E.screen.stride], ' ', E.screen.cols);
+    memset(&E.screen.back.attrs[y * E.screen.stride], ATTR_DEFAULT, E.screen.cols);
+    E.screen.back.multibyte[y] = 0;
+}
+
+// Mark the row of the frame as having non-ASCII bytes, which are written
+// up to the offset; the bytes after them are cleared to the end of the row
+void editorScreenSetMultibyte(const int y, int from) {
+    if (from < E.screen.cols) {
+        from = E.screen.cols;
+    }
+    int at = y * E.screen.stride;
+    memset(&E.screen.back.chars[at + from], ' ', (E.screen.stride - from));
+    memset(&E.screen.back.attrs[at + from], ATTR_DEFAULT, (E.screen.stride - from));
+    E.screen.back.multibyte[y] = 1;
+}
+
+// Put characters with the attribute to the frame being drawn
+void editorScreenPut(const int y, const int x, const char* s, int len,
+    const unsigned char attr) {
+    if ((x + len) > E.screen.cols) {
+        len = E.screen.cols - x;
+    }
+    if (len <= 0) {
+        return;
+    }
+
+    int at = y * E.screen.stride + x;
+    memcpy(&E.screen.back.chars[at], s, len);
+    memset(&E.screen.back.attrs[at], attr, len);
+    if (!editorIsAscii(s, len)) {
+        editorScreenSetMultibyte(y, E.screen.cols);
+    }
+}
+
+// Put the rendering characters of a row with their highlighting as the attributes
+// (the default one without the highlighting) from the offset of the row
+void editorScreenPutRender(const int y, const int x, const char* c,
+    const unsigned char* hl, const int len) {
+    char* chars = &E.screen.back.chars[y * E.screen.stride + x];
+    unsigned char* attrs = &E.screen.back.attrs[y * E.screen.stride + x];
+    memcpy(chars, c, len);
+    if (hl) {
+        memcpy(attrs, hl, len);
+    } else {
+        memset(attrs, ATTR_DEFAULT, len);
+    }
+
+    // Look for control characters and non-ASCII bytes 8 bytes at a time:
+    // a byte below 0x20 or equal to 0x7f (0 after XOR) sets the top bit
+    const unsigned long long ones = 0x0101010101010101ULL;
+    const unsigned long long highs = ones * 0x80;
+    unsigned long long bits = 0, ctrl = 0;
+    int j = 0;
+    for (; (j + 8) <= len; j += 8) {
+        unsigned long long w, del;
+        memcpy(&w, &c[j], 8);
+        del = w ^ (ones * 0x7f);
+        bits |= w;
+        ctrl |= ((w - (ones * 0x20)) & ~w) | ((del - ones) & ~del);
+    }
+    for (; j < len; j++) {
+        unsigned char ch = c[j];
+        bits |= ch;
+        ctrl |= ((ch < 0x20) || (ch == 0x7f)) ? 0x80 : 0;
+    }
+    if (bits & highs) {
+        // Bytes of a UTF-8 character take the attribute of its first byte
+        editorScreenSetMultibyte(y, (x + len));
+        for (int j = 1; j < len; j++) {
+            if ((c[j] & 0xC0) == 0x80) {
+                attrs[j] = attrs[j - 1];
+            }
+        }
+    }
+    if (!(ctrl & highs)) {
+        return;
+    }
+    // Show control characters inverted as '@' + the code or '?'
+    for (int j = 0; j < len; j++) {
+        unsigned char ch = c[j];
+        if ((ch < 0x20) || (ch == 0x7f)) {
+            chars[j] = (ch <= 26) ? ('@' + ch) : '?';
+            attrs[j] = ATTR_INVERSE | ATTR_DEFAULT;
+        }
+    }
+}
+
+// Put the columns of a render from the column, which is mapped to the offset
+// of the render by the column map unless the render is ASCII;
+// a wide character cut by either edge of the screen is left blank
+void editorScreenPutCells(const int y, const char* render, const unsigned char* hl,
+    const int* cmap, int from, const int len) {
+    if (cmap == NULL) {
+        editorScreenPutRender(y, 0, &render[from], (hl ? &hl[from] : NULL), len);
+        return;
+    }
+
+    int x = 0;
+    int to = from + len;
+    if ((to == 0) && (cmap[0] > 0)) {
+        // Zero-width characters without a column are put before the next one
+        int n = (cmap[0] < E.screen.stride) ? cmap[0] : E.screen.stride;
+        while ((n < cmap[0]) && ((render[n] & 0xC0) == 0x80)) {
+            n--;
+        }
+        editorScreenPutRender(y, 0, render, hl, n);
+        return;
+    }
+    if ((from > 0) && (cmap[from] == cmap[from - 1])) {
+        x = 1;
+        from++;
+    }
+    if ((to > from) && (cmap[to] == cmap[to - 1])) {
+        to--;
+    }
+    if (to <= from) {
+        return;
+    }
+    // Zero-width characters piling up more bytes than a row holds are cut
+    while ((cmap[to] - cmap[from]) > (E.screen.stride - x)) {
+        to--;
+    }
+    editorScreenPutRender(y, x, &render[cmap[from]], (hl ? &hl[cmap[from]] : NULL),
+        (cmap[to] - cmap[from]));
+}
+
+// State of the terminal while a frame is emitted
+struct screenCursor {
+    int y, x; // Cursor position (x is -1 when it's unknown)
+    unsigned char attr; // Current attribute
+};
+
+// Get the column from which the row of the frame is blank to the end
+int editorScreenBlankFrom(const int y) {
+    const char* chars = &E.screen.back.chars[y * E.screen.stride];
+    const unsigned char* attrs = &E.screen.back.attrs[y * E.screen.stride];
+    int x = E.screen.back.multibyte[y] ? E.screen.stride : E.screen.cols;
+    // Skip blank cells 8 at a time first
+    const unsigned long long ones = 0x0101010101010101ULL;
+    while (x >= 8) {
+        unsigned long long c, a;
+        memcpy(&c, &chars[x - 8], 8);
+        memcpy(&a, &attrs[x - 8], 8);
+        if ((c != (ones * ' ')) || (a != (ones * ATTR_DEFAULT))) {
+            break;
+        }
+        x -= 8;
+    }
+    while ((x > 0) && (chars[x - 1] == ' ') && (attrs[x - 1] == ATTR_DEFAULT)) {
+        x--;
+    }
+    return x;
+}
+
+// Move the cursor unless it's already there
+void editorScreenMove(struct abuf* ab, struct screenCursor* cur, const int y,
+    const int x) {
+    if ((cur->y == y) && (cur->x == x)) {
+        return;
+    }
+    if ((cur->y >= 0) && (y == (cur->y + 1)) && (x == 0)) {
+        // Go to the start of the next row as a repaint does
+        abAppend(ab, "\r\n", 2);
+    } else {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (y + 1), (x + 1));
+        abAppend(ab, buf, len);
+    }
+    cur->y = y;
+    cur->x = x;
+}
+
+// Set the attribute unless it looks the same as the current one
+void editorScreenAttr(struct abuf* ab, struct screenCursor* cur,
+    const unsigned char attr) {
+    unsigned char style = E.screen.style[attr];
+    if (cur->attr == style) {
+        return;
+    }
+    abAppend(ab, E.screen.sgr[style].seq, E.screen.sgr[style].len);
+    cur->attr = style;
+}
+
+// Get the end of the run of the same attribute from the column
+int editorScreenRunEnd(const unsigned char* attrs, int x, const int to) {
+    const unsigned char attr = attrs[x++];
+#if defined(__SSE2__)
+    const __m128i a = _mm_set1_epi8((char)attr);
+    for (; (x + 16) <= to; x += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&attrs[x]);
+        unsigned int diff = _mm_movemask_epi8(_mm_cmpeq_epi8(v, a)) ^ 0xffff;
+        if (diff) {
+            return x + __builtin_ctz(diff);
+        }
+    }
+#endif
+    while ((x < to) && (attrs[x] == attr)) {
+        x++;
+    }
+    return x;
+}
+
+// Emit the cells of the frame in the span of the row
+void editorScreenEmitCells(struct abuf* ab, struct screenCursor* cur, const int y,
+    const int from, const int to) {
+    const char* chars = &E.screen.back.chars[y * E.screen.stride];
+    const unsigned char* attrs = &E.screen.back.attrs[y * E.screen.stride];
+    editorScreenMove(ab, cur, y, from);
+
+    // Each run of the same attribute is copied at once after its escape sequence,
+    // which is copied in the fixed size into the space reserved for the worst case
+    char* p = abReserve(ab, (to - from) * (sizeof(E.screen.sgr[0].seq) + 1));
+    if (p == NULL) {
+        return;
+    }
+    char* start = p;
+    for (int x = from; x < to;) {
+        int end = editorScreenRunEnd(attrs, x, to);
+        unsigned char style = E.screen.style[attrs[x]];
+        if (cur->attr != style) {
+            memcpy(p, E.screen.sgr[style].seq, sizeof(E.screen.sgr[style].seq));
+            p += E.screen.sgr[style].len;
+            cur->attr = style;
+        }
+        memcpy(p, &chars[x], (end - x));
+        p += end - x;
+        x = end;
+    }
+    ab->len += p - start;
+    // The cursor waits for wrapping at the last column
+    cur->x = (to < E.screen.cols) ? to : -1;
+}
+
+// Clear the row from the column to the end
+void editorScreenEmitClear(struct abuf* ab, struct screenCursor* cur, const int y,
+    const int x) {
+    editorScreenMove(ab, cur, y, x);
+    editorScreenAttr(ab, cur, ATTR_DEFAULT);
+    // "<ESC>[K" ("[K1"): clear the current line
+    abAppend(ab, "\x1b[K", 3);
+}
+
+// Emit the whole row of the frame
+void editorScreenEmitRow(struct abuf* ab, struct screenCursor* cur, const int y) {
+    int blank = editorScreenBlankFrom(y);
+    if (E.screen.back.multibyte[y]) {
+        // Columns of the bytes are left to the terminal, so the row is cleared
+        // before them and the cursor is lost after them
+        editorScreenEmitClear(ab, cur, y, 0);
+        editorScreenEmitCells(ab, cur, y, 0, blank);
+        cur->x = -1;
+        return;
+    }
+    editorScreenEmitCells(ab, cur, y, 0, blank);
+    if (blank < E.screen.cols) {
+        editorScreenEmitClear(ab, cur, y, blank);
+    }
+}
+
+// Emit the changed spans of the row of the frame
+void editorScreenEmitDiff(struct abuf* ab, struct screenCursor* cur, const int y) {
+    int at = y * E.screen.stride;
+    const char* chars = &E.screen.back.chars[at];
+    const unsigned char* attrs = &E.screen.back.attrs[at];
+    const char* shown = &E.screen.front.chars[at];
+    const unsigned char* shown_attrs = &E.screen.front.attrs[at];
+    int multibyte = E.screen.back.multibyte[y] || E.screen.front.multibyte[y];
+    int n = multibyte ? E.screen.stride : E.screen.cols;
+    if (!memcmp(chars, shown, n) && !memcmp(attrs, shown_attrs, n)) {
+        return;
+    }
+    // A span could start in the middle of a multi-byte character
+    if (multibyte) {
+        editorScreenEmitRow(ab, cur, y);
+        return;
+    }
+
+    int blank = editorScreenBlankFrom(y);
+    int x = 0;
+    while (x < E.screen.cols) {
+        if ((chars[x] == shown[x]) && (attrs[x] == shown_attrs[x])) {
+            x++;
+            continue;
+        }
+        if (x >= blank) {
+            editorScreenEmitClear(ab, cur, y, x);
+            return;
+        }
+
+        // Join changes separated by a few unchanged cells into a span
+        int end = x + 1;
+        for (int i = end, gap = 0; (i < blank) && (gap <= KILO_DIFF_GAP); i++) {
+            if ((chars[i] == shown[i]) && (attrs[i] == shown_attrs[i])) {
+                gap++;
+            } else {
+                gap = 0;
+                end = i + 1;
+            }
+        }
+        editorScreenEmitCells(ab, cur, y, x, end);
+        x = end;
+    }
+}
+
+// Scroll the text rows on the terminal by the lines (up when positive)
+// and the cells shown along, the rows exposed are left blank for the diff
+void editorScreenScroll(struct abuf* ab, const int lines) {
+    int text = E.screen.rows - 2;
+    int n = (lines > 0) ? lines : -lines;
+    if ((n == 0) || (n >= text)) {
+        return;
+    }
+    // "<ESC>[1;<rows>r": limit scrolling to the text rows (DECSTBM),
+    // "<ESC>[<n>S" / "<ESC>[<n>T": scroll up / down in it (SU / SD)
+    // "<ESC>[r": restore the whole screen, the cursor goes home
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", text, n,
+        ((lines > 0) ? 'S' : 'T'));
+    abAppend(ab, buf, len);
+
+    struct screenGrid* shown = &E.screen.front;
+    int stride = E.screen.stride;
+    int from = (lines > 0) ? n : 0;
+    int to = (lines > 0) ? 0 : n;
+    int blank = (lines > 0) ? (text - n) : 0;
+    memmove(&shown->chars[to * stride], &shown->chars[from * stride], (text - n) * stride);
+    memmove(&shown->attrs[to * stride], &shown->attrs[from * stride], (text - n) * stride);
+    memmove(&shown->multibyte[to], &shown->multibyte[from], (text - n));
+    memset(&shown->chars[blank * stride], ' ', n * stride);
+    memset(&shown->attrs[blank * stride], ATTR_DEFAULT, n * stride);
+    memset(&shown->multibyte[blank], 0, n);
+    E.screen.scrolls++;
+}
+
+// Emit the frame, only the cells different from the terminal are drawn
+// unless the whole screen is repainted, then the cursor is placed
+void editorScreenFlush(struct abuf* ab, const int full, const int cy, const int cx) {
+    struct screenCursor cur = { -1, -1, ATTR_DEFAULT };
+    if (full) {
+        abAppend(ab, "\x1b[m", 3);
+    }
+    for (int y = 0; y < E.screen.rows; y++) {
+        if (full) {
+            editorScreenEmitRow(ab, &cur, y);
+        } else {
+            editorScreenEmitDiff(ab, &cur, y);
+        }
+    }
+    editorScreenAttr(ab, &cur, ATTR_DEFAULT);
+    editorScreenMove(ab, &cur, cy, cx);
+
+    // The terminal shows the frame now
+    struct screenGrid shown = E.screen.front;
+    E.screen.front = E.screen.back;
+    E.screen.back = shown;
+    E.screen.valid = 1;
+    E.screen.frames++;
+    if (full) {
+        E.screen.full_frames++;
+    }
+}
+
 /*** output ***/
 
+// Count the screen lines of the rows from the top of the screen to the cursor
+// from their columns, the ones not rendered yet have them estimated from
+// their size and would put the cursor on a wrong line
+void editorCountLinesToCursor(void) {
+    // A cursor further below has only a screen of rows above it on the screen
+    int first = E.rowoff;
+    if (first < E.cy - E.screenrows) {
+        first = E.cy - E.screenrows;
+    }
+    for (int y = first; (y < E.cy) && (y < E.numrows); y++) {
+        erow* row = editorRowAt(y);
+        if (!row->render) {
+            editorRowSetLines(row, editorRowCxToRx(row, row->size));
+        }
+    }
+}
+
 // Scroll the screen
 void editorScroll(void) {
     // Set rendering index
     E.rx = 0;
     if (E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
+    }
+
+    // Wrapped rows scroll by screen lines and never horizontally
+    if (E.wrap) {
+        editorCountLinesToCursor();
+        E.cline = E.rowtree->lines;
+        if (E.cy < E.numrows) {
+            erow* row = editorRowAt(E.cy);
+            editorRowMaterialize(row);
+            E.cline = editorRowLine(row) + (E.rx / E.screencols);
+        }
+        if (E.cline < E.lineoff) {
+            E.lineoff = E.cline;
+        }
+        if (E.cline >= E.lineoff + E.screenrows) {
+            E.lineoff = E.cline - E.screenrows + 1;
+        }
+        int line = E.lineoff;
+        E.rowoff = editorRowAtLine(&line);
+        E.coloff = 0;
+        return;
     }
 
     // Set rendering position
@@ -939,10 +4796,33 @@ void editorScroll(void) {
     }
 }
 
+// Draw cells of the row from its characters as plain text, without building
+// the render and the highlighting
+void editorDrawRowPlain(const int y, erow* row, const int rx) {
+    int cx = editorRowRxToCx(row, rx);
+    if (cx >= row->size) {
+        return;
+    }
+    // The first character may be a tab or a wide one starting before the column
+    int start = editorRowCxToRx(row, cx);
+    char* text = E.screen.plain;
+    char* cells = &E.screen.plain[E.screen.stride + KILO_TAB_STOP];
+    int n = editorRowCopy(row, cx, (E.screen.stride + KILO_TAB_STOP), text);
+    int cols = editorRenderChars(text, n, start, (rx - start + E.screencols), cells,
+        NULL, NULL, E.screen.plainmap);
+    int len = cols - (rx - start);
+    if (len > E.screencols) {
+        len = E.screencols;
+    }
+    editorScreenPutCells(y, cells, NULL, E.screen.plainmap, (rx - start), len);
+}
+
 // Draw rows
-void editorDrawRows(struct abuf* ab) {
+void editorDrawRows(void) {
+    int sub = E.lineoff; // Screen line in the row when wrapped
+    int filerow = E.wrap ? editorRowAtLine(&sub) : E.rowoff;
     for (int y = 0; y < E.screenrows; y++) {
-        int filerow = y + E.rowoff;
+        editorScreenClearRow(y);
         if (filerow >= E.numrows) {
             // If there are no editor rows:
             // Draw editor titles at the center of the screen
@@ -957,135 +4837,172 @@ void editorDrawRows(struct abuf* ab) {
                 // Do centering of the titles
                 int padding = (E.screencols - welcomelen) / 2;
                 if (padding) {
-                    abAppend(ab, "~", 1);
-                    padding--;
+                    editorScreenPut(y, 0, "~", 1, ATTR_DEFAULT);
                 }
-                while (padding--) {
-                    abAppend(ab, " ", 1);
-                }
-                abAppend(ab, welcome, welcomelen);
+                editorScreenPut(y, padding, welcome, welcomelen, ATTR_DEFAULT);
             } else {
-                abAppend(ab, "~", 1);
+                editorScreenPut(y, 0, "~", 1, ATTR_DEFAULT);
             }
         } else {
             // Draw the rendering rows
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0) {
-                len = 0;
-            }
-            if (len > E.screencols) {
-                len = E.screencols;
-            }
-            char* c = &E.row[filerow].render[E.coloff];
-            unsigned char* hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1;
-            for (int j = 0; j < len; j++) {
-                if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26) ? ('@' + c[j]) : '?';
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    if (current_color != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        abAppend(ab, buf, clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        abAppend(ab, "\x1b[39m", 5); // Set the text color back to normal
-                        current_color = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
-                } else {
-                    // Apply a color by the highlighting value when it is chahged
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (color != current_color) {
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
+            erow* row = editorRowAt(filerow);
+            int rx = E.wrap ? (sub * E.screencols) : E.coloff;
+            if (E.screen.degraded && (filerow != E.cy) && (row->windowed ||
+                !row->render || (!row->hl_pending && !editorRowFresh(row, filerow)))) {
+                // Rows not highlighted yet (and long rows) are drawn as plain
+                // text while the frames are degraded, except the cursor row
+                if (E.wrap) {
+                    editorRowSetLines(row, editorRowCxToRx(row, row->size));
+                }
+                editorDrawRowPlain(y, row, rx);
+            } else {
+                editorRowMaterialize(row);
+                int len = row->rsize - rx;
+                if (len < 0) {
+                    len = 0;
+                }
+                if (len > E.screencols) {
+                    len = E.screencols;
+                }
+                if (len > 0) {
+                    editorRowWindow(row, rx, len);
+                    editorScreenPutCells(y, row->render, row->hl, row->cmap,
+                        (rx - row->wrx), len);
+                } else if ((rx == 0) && !row->windowed) {
+                    // Zero-width characters may be all the row has
+                    editorScreenPutCells(y, row->render, row->hl, row->cmap, 0, 0);
                 }
             }
-            abAppend(ab, "\x1b[39m", 5);
-        }
 
-        // "<ESC>[K" ("[K1"): clear the current line
-        abAppend(ab, "\x1b[K", 3);
-        abAppend(ab, "\r\n", 2);
+            // A wrapped row goes on to the next screen line
+            if (E.wrap && (++sub < row->lines)) {
+                continue;
+            }
+        }
+        filerow++;
+        sub = 0;
     }
 }
 
 // Draw status bar
-void editorDrawStatusBar(struct abuf* ab) {
-    abAppend(ab, "\x1b[7m", 4); // Invert color
+void editorDrawStatusBar(void) {
+    int y = E.screenrows;
+    editorScreenClearRow(y);
     // Copy the file name
     char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-        (E.filename ? E.filename : "[No Name]"), E.numrows,
+    char loading[24] = "";
+    if (E.loader.active) {
+        snprintf(loading, sizeof(loading), " (loading %d%%)",
+            (int)(E.loader.start * 100 / E.loader.len));
+    }
+    int len = snprintf(status, sizeof(status), "%.20s - %d lines%s %s",
+        (E.filename ? E.filename : "[No Name]"), E.numrows, loading,
         (E.dirty ? "(modified)" : ""));
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s %d/%d",
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s %d/%d",
+        (E.screen.degraded ? "(degraded) " : ""),
         (E.syntax ? E.syntax->filetype : "no ft"),
         (E.cy + 1), E.numrows);
     if (len > E.screencols) {
         len = E.screencols;
     }
-    abAppend(ab, status, len);
-    // Draw the status
-    while (len < E.screencols) {
-        if ((E.screencols - len) == rlen) {
-            abAppend(ab, rstatus, rlen);
-            break;
-        } else {
-            abAppend(ab, " ", 1);
-            len++;
-        }
+    // Draw the status with inverted color
+    memset(&E.screen.back.attrs[y * E.screen.stride], (ATTR_INVERSE | ATTR_DEFAULT),
+        E.screen.cols);
+    editorScreenPut(y, 0, status, len, (ATTR_INVERSE | ATTR_DEFAULT));
+    if ((E.screencols - len) >= rlen) {
+        editorScreenPut(y, (E.screencols - rlen), rstatus, rlen,
+            (ATTR_INVERSE | ATTR_DEFAULT));
     }
-    abAppend(ab, "\x1b[m", 3); // Restore default formatting
-    abAppend(ab, "\r\n", 2);
 }
 
 // Draw the message bar
-void editorDrawMessageBar(struct abuf* ab) {
+void editorDrawMessageBar(void) {
+    int y = E.screenrows + 1;
     // Clear the message bar
-    abAppend(ab, "\x1b[K", 3);
+    editorScreenClearRow(y);
     int msg_len = strlen(E.statusmsg);
     if (msg_len > E.screencols) {
         msg_len = E.screencols;
     }
     // Disappear when any key is pressed after 5 seconds from the start
     if (msg_len && (time(NULL) - E.statusmsg_time < 5)) {
-        abAppend(ab, E.statusmsg, msg_len);
+        editorScreenPut(y, 0, E.statusmsg, msg_len, ATTR_DEFAULT);
     }
 }
 
 // Refresh screen
 void editorRefreshScreen(void) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     editorScroll();
 
-    struct abuf ab = ABUF_INIT;
+    editorDrawRows();
+    editorDrawStatusBar();
+    editorDrawMessageBar();
+
+    // The buffer is kept across frames, so it stops growing once
+    // it fits the largest frame
+    static struct abuf ab = ABUF_INIT;
+    size_t grows = ab.grows;
+    ab.len = 0;
 
+    // "<ESC>[?2026h": hold the display until the whole frame arrives
+    if (E.screen.sync) {
+        abAppend(&ab, "\x1b[?2026h", 8);
+    }
     // "<ESC>[?25l": make the cursor invisible (in VT-510 terminal)
     abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H", 3);
-
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
 
-    // Refer the cursor position
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
-        (E.cy - E.rowoff + 1), (E.rx - E.coloff + 1));
-    abAppend(&ab, buf, strlen(buf));
+    // Scroll the terminal when the text moves vertically by a few rows,
+    // then draw the frame and refer the cursor position
+    int full = !KILO_DIFF_RENDER || !E.screen.valid;
+    int top = E.wrap ? E.lineoff : E.rowoff;
+    if (KILO_HW_SCROLL && !full && (E.coloff == E.screen.coloff)) {
+        editorScreenScroll(&ab, (top - E.screen.rowoff));
+    }
+    if (E.wrap) {
+        editorScreenFlush(&ab, full, (E.cline - E.lineoff), (E.rx % E.screencols));
+    } else {
+        editorScreenFlush(&ab, full, (E.cy - E.rowoff), (E.rx - E.coloff));
+    }
+    E.screen.rowoff = top;
+    E.screen.coloff = E.coloff;
 
     // "<ESC>[?25h": make the cursor visible (same with the above)
     abAppend(&ab, "\x1b[?25h", 6);
+    // "<ESC>[?2026l": show the frame
+    if (E.screen.sync) {
+        abAppend(&ab, "\x1b[?2026l", 8);
+    }
 
     // Draw append buffer
     WRITE_WITH_CHECK(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+    E.screen.last_bytes = ab.len;
+    E.screen.bytes += ab.len;
+    E.screen.last_grows = ab.grows - grows;
+    E.screen.grows = ab.grows;
+    E.screen.capacity = ab.cap;
+
+    // A frame over the budget degrades the following ones until keys stop
+    E.screen.last_ms = editorElapsed(&start) * 1000;
+    if ((E.screen.last_ms > KILO_FRAME_BUDGET_MS) && !E.screen.degraded) {
+        E.screen.degraded = 1;
+        E.screen.degrades++;
+    }
+
+    // Rows drawn with their old highlighting are lexed in the background
+    editorHighlighterSubmit();
+}
+
+// Refresh the screen unless keys are waiting, they are processed
+// before a frame shows them all
+void editorRefreshIfIdle(void) {
+    struct pollfd fd = { STDIN_FILENO, POLLIN, 0 };
+    if (editorTypedPending() || (poll(&fd, 1, 0) > 0)) {
+        E.screen.skipped++;
+        return;
+    }
+    editorRefreshScreen();
 }
 
 // Set string to the status bar
@@ -1097,8 +5014,131 @@ void editorSetStatusMessage(const char* fmt, ...) {
     E.statusmsg_time = time(NULL);
 }
 
+// Show the statistics of the buffer on the status bar, a page at a time
+void editorShowStats(void) {
+    static int page = 0;
+
+    const struct arena* a = &E.rowarena;
+    switch (page) {
+        case 0:
+            {
+                size_t bytes;
+                size_t live = editorArenaLive(a, &bytes);
+                editorSetStatusMessage("arena %s: %zu slabs, %zu large, "
+                    "%zu live (%zu KB), %zu allocs, %zu frees, %zu reused",
+                    a->name, a->nslabs, a->nlarge, live, (bytes / 1024),
+                    a->allocs, a->frees, a->reused);
+            }
+            break;
+        case 1:
+            editorSetStatusMessage("arena %s: growth %zu in place, %zu moved | "
+                "render cache: %d/%d rows, %zu evicted", a->name, a->in_place,
+                a->moved, E.cache.n, KILO_RENDER_CACHE, E.cache.evicted);
+            break;
+        case 2:
+            editorSetStatusMessage("screen: %zu frames (%zu full, %zu scrolled), "
+                "last %zu bytes, %zu bytes/frame on average", E.screen.frames,
+                E.screen.full_frames, E.screen.scrolls, E.screen.last_bytes,
+                (E.screen.frames ? (E.screen.bytes / E.screen.frames) : 0));
+            break;
+        case 3:
+            editorSetStatusMessage("input: %zu keys, %zu frames skipped, "
+                "%.1f keys/frame, synchronized output %s", E.screen.keys,
+                E.screen.skipped,
+                (E.screen.frames ? ((double)E.screen.keys / E.screen.frames) : 0.0),
+                (E.screen.sync ? "on" : "off"));
+            break;
+        case 4:
+            editorSetStatusMessage("frame buffer: %d bytes, %zu reallocations, "
+                "%zu by the last frame", E.screen.capacity, E.screen.grows,
+                E.screen.last_grows);
+            break;
+        case 5:
+            editorSetStatusMessage("frame time: last %.1f ms, budget %d ms, "
+                "degraded %zu times%s", E.screen.last_ms, KILO_FRAME_BUDGET_MS,
+                E.screen.degrades, (E.screen.degraded ? " (now)" : ""));
+            break;
+        case 6:
+            editorSetStatusMessage("highlighter: %s, %zu jobs, %zu rows applied, "
+                "%zu dropped, %d saved states", (E.highlighter.active ? "on" : "off"),
+                E.highlighter.jobs, E.highlighter.applied, E.highlighter.dropped,
+                E.hl_nmarks);
+            break;
+        default:
+            {
+                int nblocks = 0;
+                size_t used = 0;
+                for (struct addBlock* blk = E.tb.add; blk; blk = blk->prev) {
+                    nblocks++;
+                    used += blk->used;
+                }
+                editorSetStatusMessage("text: %zu KB original (%s), "
+                    "%d add blocks (%zu KB used)", (E.tb.orig_len / 1024),
+                    (E.tb.orig_mapped ? "mapped" : "read"), nblocks, (used / 1024));
+            }
+            break;
+    }
+    page = (page + 1) % 8;
+}
+
 /*** input ***/
 
+// Wait for a key while jobs are running in the background,
+// their progress is taken and shown in the meantime
+void editorWaitKey(void) {
+    while (!editorTypedPending() &&
+           (E.loader.active || E.saver.active || E.highlighter.given)) {
+        struct pollfd fds[4] = { { STDIN_FILENO, POLLIN, 0 } };
+        int nfds = 1;
+        int loader = -1;
+        int saver = -1;
+        int highlighter = -1;
+        if (E.loader.active) {
+            loader = nfds;
+            fds[nfds++] = (struct pollfd){ E.loader.notify[0], POLLIN, 0 };
+        }
+        if (E.saver.active) {
+            saver = nfds;
+            fds[nfds++] = (struct pollfd){ E.saver.notify[0], POLLIN, 0 };
+        }
+        if (E.highlighter.given) {
+            highlighter = nfds;
+            fds[nfds++] = (struct pollfd){ E.highlighter.notify[0], POLLIN, 0 };
+        }
+
+        int timeout = (E.loader.active && editorLoaderPending()) ? 0 : -1;
+        if (poll(fds, nfds, timeout) == -1) {
+            if (errno != EINTR) {
+                die("poll");
+            }
+            continue;
+        }
+        if (fds[0].revents) {
+            return;
+        }
+
+        if (loader != -1) {
+            editorLoaderWake(fds[loader].revents);
+        }
+        if ((saver != -1) && fds[saver].revents) {
+            editorSaverFinish();
+        }
+        if ((highlighter != -1) && fds[highlighter].revents) {
+            editorHighlighterFinish();
+        }
+        editorRefreshScreen();
+    }
+
+    // Degraded frames are drawn in full again once keys stop for a while
+    if (E.screen.degraded && !editorTypedPending()) {
+        struct pollfd fd = { STDIN_FILENO, POLLIN, 0 };
+        if (poll(&fd, 1, KILO_IDLE_MS) == 0) {
+            E.screen.degraded = 0;
+            editorRefreshScreen();
+        }
+    }
+}
+
 // Show a prompt and execute a callback set by the user input
 char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
     size_t bufsize = 128;
@@ -1109,10 +5149,14 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
 
     while (1) {
         editorSetStatusMessage(prompt, buf);
-        editorRefreshScreen();
+        editorRefreshIfIdle();
 
         int c = editorReadKey();
         if ((c == DEL_KEY) || (c == CTRL_KEY('h')) || (c == BACKSPACE)) {
+            // Drop the continuation bytes of a UTF-8 character with its first one
+            while ((buflen != 0) && ((buf[buflen - 1] & 0xC0) == 0x80)) {
+                buflen--;
+            }
             if (buflen != 0) {
                 buf[--buflen] = '\0';
             }
@@ -1131,7 +5175,7 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
                 }
                 return buf;
             }
-        } else if (!iscntrl(c) && (c < 128)) {
+        } else if ((c < 256) && ((c >= 128) || !iscntrl(c))) {
             if (buflen == (bufsize - 1)) {
                 bufsize *= 2;
                 buf = realloc(buf, bufsize);
@@ -1146,22 +5190,61 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
     }
 }
 
+// Move the cursor to the screen line of the wrapped rows,
+// keeping the column on the screen
+void editorMoveCursorToLine(const int line) {
+    int x = 0;
+    if (E.cy < E.numrows) {
+        x = editorRowCxToRx(editorRowAt(E.cy), E.cx) % E.screencols;
+    }
+
+    int sub = line;
+    E.cy = editorRowAtLine(&sub);
+    E.cx = 0;
+    if (E.cy < E.numrows) {
+        erow* row = editorRowAt(E.cy);
+        editorRowMaterialize(row);
+        E.cx = editorRowRxToCx(row, (sub * E.screencols + x));
+        // A tab or a wide character continued from the previous line is stepped over
+        if ((E.cx < row->size) && (editorRowCxToRx(row, E.cx) < (sub * E.screencols))) {
+            E.cx = editorRowNextChar(row, E.cx);
+        }
+    } else {
+        E.cy = E.numrows;
+    }
+}
+
 // Move the cursor by a key code
 void editorMoveCursor(const int key) {
-    erow* row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow* row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
+
+    // Wrapped rows are moved through by screen lines
+    if (E.wrap && ((key == ARROW_UP) || (key == ARROW_DOWN))) {
+        int line = E.rowtree->lines;
+        if (row) {
+            editorRowMaterialize(row);
+            line = editorRowLine(row) + (editorRowCxToRx(row, E.cx) / E.screencols);
+        }
+        if ((key == ARROW_UP) && (line > 0)) {
+            editorMoveCursorToLine(line - 1);
+        } else if ((key == ARROW_DOWN) && row) {
+            editorMoveCursorToLine(line + 1);
+        }
+        return;
+    }
 
     switch (key) {
         case ARROW_LEFT:
             if (E.cx != 0) {
-                E.cx--;
+                E.cx = editorRowPrevChar(row, E.cx);
             } else if (E.cy > 0) {
                 E.cy--;
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             }
             break;
         case ARROW_RIGHT:
             if (row && (E.cx  < row->size)) {
-                E.cx++;
+                E.cx = editorRowNextChar(row, E.cx);
             } else if (row && (E.cx == row->size)) {
                 E.cy++;
                 E.cx = 0;
@@ -1182,7 +5265,7 @@ void editorMoveCursor(const int key) {
     }
 
     // Snap cursor to the end of line
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
     int row_len = row ? row->size : 0;
     if (E.cx > row_len) {
         E.cx = row_len;
@@ -1208,6 +5291,8 @@ void editorProcessKeypress(void) {
                 quit_times--;
                 return;
             }
+            // Let the file being saved complete
+            editorSaverFinish();
             WRITE_WITH_CHECK(STDOUT_FILENO, "\x1b[2J", 4);
             WRITE_WITH_CHECK(STDOUT_FILENO, "\x1b[H", 3);
             exit(0);
@@ -1224,7 +5309,7 @@ void editorProcessKeypress(void) {
             break;
         case END_KEY:
             if (E.cy < E.numrows) {
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             }
             break;
 
@@ -1244,6 +5329,20 @@ void editorProcessKeypress(void) {
         case PAGE_UP:
         case PAGE_DOWN:
             {
+                if (E.wrap) {
+                    // Move by a screen of lines from the top or the bottom line
+                    int line = (c == PAGE_UP) ? (E.lineoff - E.screenrows) :
+                        (E.lineoff + 2 * E.screenrows - 1);
+                    if (line < 0) {
+                        line = 0;
+                    }
+                    if (line > E.rowtree->lines) {
+                        line = E.rowtree->lines;
+                    }
+                    editorMoveCursorToLine(line);
+                    break;
+                }
+
                 if (c == PAGE_UP) {
                     E.cy = E.rowoff;
                 } else if (c == PAGE_DOWN) {
@@ -1266,7 +5365,27 @@ void editorProcessKeypress(void) {
             editorMoveCursor(c);
             break;
 
+        case CTRL_KEY('g'):
+            editorShowStats();
+            break;
+
+        // Toggle wrapping the rows at the screen width
+        case CTRL_KEY('w'):
+            // The row at the top stays there
+            E.wrap = !E.wrap;
+            if (E.wrap) {
+                E.lineoff = (E.rowoff < E.numrows) ?
+                    editorRowLine(editorRowAt(E.rowoff)) : E.rowtree->lines;
+            }
+            E.screen.valid = 0;
+            editorSetStatusMessage("Soft wrap %s", (E.wrap ? "on" : "off"));
+            break;
+
+        // Repaint the whole screen
         case CTRL_KEY('l'):
+            E.screen.valid = 0;
+            break;
+
         case '\x1b': // ESC
             break;
 
@@ -1289,12 +5408,37 @@ void initEditor(void) {
     E.rowoff = 0;
     E.coloff = 0;
     E.numrows = 0;
-    E.row = NULL;
+    E.wrap = KILO_SOFT_WRAP;
+    E.lineoff = 0;
+    E.cline = 0;
+    E.rowarena.name = "rows";
+    E.cache.head = NULL;
+    E.cache.tail = NULL;
+    E.cache.n = 0;
+    E.cache.evicted = 0;
+    E.hl_gen = 1;
+    E.hl_stale = INT_MAX;
+    E.hl_stales = NULL;
+    E.hl_nstales = 0;
+    E.hl_stalecap = 0;
+    E.hl_marks = NULL;
+    E.hl_nmarks = 0;
+    E.hl_markcap = 0;
+    E.ntyped = 0;
+    E.typedpos = 0;
+    E.rowtree = editorRowNodeNew(1);
+    E.tb.orig = NULL;
+    E.tb.orig_len = 0;
+    E.tb.orig_mapped = 0;
+    E.tb.add = NULL;
     E.dirty = 0;
     E.filename = NULL;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
     E.syntax = NULL;
+    E.keywords.seeds = NULL;
+    E.keywords.slots = NULL;
+    E.keywords.nslots = 0;
 
     // Save the current window size
     if (getWindowSize(&E.screenrows, &E.screencols) == -1) {
@@ -1302,8 +5446,14 @@ void initEditor(void) {
     }
 
     E.screenrows -= 2;
+    editorScreenInit();
+    E.screen.sync = KILO_SYNC_OUTPUT && getSynchronizedOutput();
+    if (KILO_HL_THREAD) {
+        editorHighlighterStart();
+    }
 }
 
+#ifndef KILO_NO_MAIN
 int main(int argc, char* argv[]) {
     enableRawMode();
     initEditor();
@@ -1312,13 +5462,14 @@ int main(int argc, char* argv[]) {
     }
 
     editorSetStatusMessage(
-        "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find"
+        "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-G = stats"
     );
 
     while (1) {
-        editorRefreshScreen();
+        editorRefreshIfIdle();
         editorProcessKeypress();
     }
 
     return 0;
 }
+#endif